@@ -0,0 +1,156 @@
+/* -*- C -*-
+ * scullfault.h -- latency histograms for the mmap paths of scullp,
+ *                 sculld and scullv
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * The same as scull/latency.c does for read and write, for page
+ * faults and for the mapping of huge quanta at mmap time: the time
+ * spent, in all and waiting for the device semaphore, is counted in
+ * log2 histograms, in debugfs under the name of the module; writing
+ * to a file clears it. The tracepoints can't be shared, as their
+ * names must be unique: each module has its own in trace.h.
+ *
+ * Only mmap.c includes this, and gets its own copy of everything.
+ */
+
+#ifndef _SCULLFAULT_H_
+#define _SCULLFAULT_H_
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>	/* fls64() */
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+
+#define SCULL_VM_FAULT     0	/* one page, from "nopage" */
+#define SCULL_VM_POPULATE  1	/* a whole mapping, at mmap time */
+#define SCULL_VM_NR        2
+
+#define SCULL_VM_BUCKETS  40	/* up to 2^39 ns, some nine minutes */
+
+struct scull_vm_hist {
+	atomic_long_t count[SCULL_VM_BUCKETS];
+};
+
+static struct scull_vm_hist scull_vm_total[SCULL_VM_NR];
+static struct scull_vm_hist scull_vm_wait[SCULL_VM_NR];
+
+static const char *scull_vm_names[SCULL_VM_NR] = {
+	[SCULL_VM_FAULT]    = "fault",
+	[SCULL_VM_POPULATE] = "populate",
+};
+
+static struct dentry *scull_vm_dir;
+
+static void scull_vm_hist_add(struct scull_vm_hist *hist, s64 ns)
+{
+	int bucket = ns > 0 ? fls64(ns) : 0;
+
+	if (bucket >= SCULL_VM_BUCKETS)
+		bucket = SCULL_VM_BUCKETS - 1;
+	atomic_long_inc(&hist->count[bucket]);
+}
+
+/*
+ * "locked" is when the semaphore was taken; the times are returned
+ * for the tracepoint.
+ */
+static void scull_vm_account(int op, ktime_t start, ktime_t locked,
+		s64 *wait, s64 *total)
+{
+	*wait = ktime_to_ns(ktime_sub(locked, start));
+	*total = ktime_to_ns(ktime_sub(ktime_get(), start));
+	scull_vm_hist_add(scull_vm_wait + op, *wait);
+	scull_vm_hist_add(scull_vm_total + op, *total);
+}
+
+/*
+ * The debugfs files: one line per bucket that is not empty.
+ */
+static int scull_vm_hist_show(struct seq_file *s, void *v)
+{
+	struct scull_vm_hist *hist = s->private;
+	unsigned long n;
+	int i;
+
+	seq_printf(s, "%12s %12s %10s\n", "from(ns)", "to(ns)", "count");
+	for (i = 0; i < SCULL_VM_BUCKETS; i++) {
+		n = atomic_long_read(&hist->count[i]);
+		if (n)
+			seq_printf(s, "%12llu %12llu %10lu\n",
+					i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, n);
+	}
+	return 0;
+}
+
+static int scull_vm_hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, scull_vm_hist_show, inode->i_private);
+}
+
+static ssize_t scull_vm_hist_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct scull_vm_hist *hist = ((struct seq_file *)filp->private_data)->private;
+	int i;
+
+	for (i = 0; i < SCULL_VM_BUCKETS; i++)
+		atomic_long_set(&hist->count[i], 0);
+	return count;
+}
+
+static struct file_operations scull_vm_hist_fops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_vm_hist_open,
+	.read    = seq_read,
+	.write   = scull_vm_hist_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Without debugfs, the tracepoints and histograms still work; there's
+ * just no way to read the latter.
+ */
+static void scull_vm_lat_init(const char *dirname)
+{
+	char name[32];
+	int i;
+
+	scull_vm_dir = debugfs_create_dir(dirname, NULL);
+	if (IS_ERR_OR_NULL(scull_vm_dir)) {
+		scull_vm_dir = NULL;
+		return;
+	}
+	for (i = 0; i < SCULL_VM_NR; i++) {
+		debugfs_create_file(scull_vm_names[i], S_IRUSR | S_IWUSR,
+				scull_vm_dir, scull_vm_total + i,
+				&scull_vm_hist_fops);
+		snprintf(name, sizeof(name), "%s_lock_wait", scull_vm_names[i]);
+		debugfs_create_file(name, S_IRUSR | S_IWUSR, scull_vm_dir,
+				scull_vm_wait + i, &scull_vm_hist_fops);
+	}
+}
+
+static void scull_vm_lat_cleanup(void)
+{
+	debugfs_remove_recursive(scull_vm_dir); /* NULL is fine */
+	scull_vm_dir = NULL;
+}
+
+#endif /* _SCULLFAULT_H_ */
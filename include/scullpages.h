@@ -0,0 +1,258 @@
+/* -*- C -*-
+ * scullpages.h -- quanta made of whole pages, for scullp and sculld
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * scullp and sculld differ only in how they show up in the driver
+ * model: the way they get pages for their quanta, place them on NUMA
+ * nodes and fall back to lower orders is the same, and lives here.
+ * Everything is static inline, so each module has its own copy and
+ * there is no extra module to load.
+ */
+
+#ifndef _SCULLPAGES_H_
+#define _SCULLPAGES_H_
+
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+/*
+ * NUMA placement of the quanta: on the node of the writer (the
+ * historical behaviour), on a fixed node, or round-robin over all
+ * online nodes.
+ */
+#define SCULL_NUMA_LOCAL       0
+#define SCULL_NUMA_NODE        1
+#define SCULL_NUMA_INTERLEAVE  2
+
+/*
+ * Quanta are allocated at the device order when possible, and from
+ * smaller blocks when memory is fragmented. This is the size of the
+ * histogram of the orders achieved, large enough for any MAX_ORDER.
+ */
+#define SCULL_NR_ORDERS        16
+
+/*
+ * Placement and usage of a device; only the head of the list of
+ * items has one.
+ */
+struct scull_pages {
+	int numa_policy;          /* SCULL_NUMA_*, see above */
+	int numa_node;            /* node for SCULL_NUMA_NODE */
+	int numa_next;            /* next node for SCULL_NUMA_INTERLEAVE */
+	__u64 order_hist[SCULL_NR_ORDERS]; /* quanta per order, since trim */
+	unsigned long node_pages[0]; /* pages allocated on each node */
+};
+
+static inline int scull_pages_set_numa(struct scull_pages *pp, int policy,
+		int node)
+{
+	if (policy < SCULL_NUMA_LOCAL || policy > SCULL_NUMA_INTERLEAVE)
+		return -EINVAL;
+	if (policy == SCULL_NUMA_NODE && (node < 0 ||
+			node >= MAX_NUMNODES || !node_online(node)))
+		return -EINVAL;
+	pp->numa_policy = policy;
+	pp->numa_node = node;
+	return 0;
+}
+
+static inline struct scull_pages *scull_pages_create(void)
+{
+	struct scull_pages *pp;
+
+	pp = kzalloc(sizeof(struct scull_pages) +
+			nr_node_ids * sizeof(unsigned long), GFP_KERNEL);
+	if (pp)
+		pp->numa_next = first_online_node;
+	return pp;
+}
+
+/*
+ * Allocate a block of pages according to the NUMA policy of the
+ * device. Allocation may still fall back to another node when the
+ * chosen one is short on memory, so the usage is accounted on the
+ * node we got. Blocks are compound pages, so that mmap can hand out
+ * pages from inside them.
+ */
+static inline void *scull_pages_alloc(struct scull_pages *pp, int order,
+		gfp_t flags)
+{
+	struct page *page;
+	int nid;
+
+	flags |= GFP_KERNEL | __GFP_COMP;
+	switch (pp->numa_policy) {
+	case SCULL_NUMA_NODE:
+		page = alloc_pages_exact_node(pp->numa_node, flags, order);
+		break;
+
+	case SCULL_NUMA_INTERLEAVE:
+		nid = pp->numa_next;
+		if (!node_online(nid))
+			nid = first_online_node;
+		pp->numa_next = next_online_node(nid);
+		if (pp->numa_next == MAX_NUMNODES)
+			pp->numa_next = first_online_node;
+		page = alloc_pages_exact_node(nid, flags, order);
+		break;
+
+	default: /* SCULL_NUMA_LOCAL: whatever the writer's policy says */
+		page = alloc_pages(flags, order);
+		break;
+	}
+	if (!page)
+		return NULL;
+	pp->node_pages[page_to_nid(page)] += 1 << order;
+	return page_address(page);
+}
+
+static inline void scull_pages_free(struct scull_pages *pp, void *addr,
+		int order)
+{
+	pp->node_pages[page_to_nid(virt_to_page(addr))] -= 1 << order;
+	free_pages((unsigned long) addr, order);
+}
+
+/*
+ * Allocate quantum "s_pos" of an item, whose array of quanta is
+ * "data". When memory is too fragmented for a block of the device
+ * order, the quantum is made of several smaller blocks of a lower
+ * order, down to single pages: then data[s_pos] points to an array
+ * of blocks, and the order used is recorded in (*orders)[s_pos],
+ * which is allocated the first time it is needed. Only the last
+ * attempt, at order 0, is allowed to try hard and warn. The order
+ * achieved is counted in the histogram.
+ */
+static inline int scull_pages_alloc_quantum(struct scull_pages *pp,
+		int devorder, int qset, void **data, unsigned char **orders,
+		int s_pos)
+{
+	int order = devorder, i, n;
+	void **blocks;
+
+	data[s_pos] = scull_pages_alloc(pp, order,
+			order ? __GFP_NORETRY | __GFP_NOWARN : 0);
+	if (data[s_pos]) {
+		memset(data[s_pos], 0, PAGE_SIZE << order);
+		goto done;
+	}
+	if (!order)
+		return -ENOMEM;
+
+	if (!*orders) {
+		*orders = kmalloc(qset, GFP_KERNEL);
+		if (!*orders)
+			return -ENOMEM;
+		memset(*orders, devorder, qset);
+	}
+	for (order--; order >= 0; order--) {
+		n = 1 << (devorder - order);
+		blocks = kmalloc(n * sizeof(void *), GFP_KERNEL);
+		if (!blocks)
+			return -ENOMEM;
+		for (i = 0; i < n; i++) {
+			blocks[i] = scull_pages_alloc(pp, order,
+					order ? __GFP_NORETRY | __GFP_NOWARN : 0);
+			if (!blocks[i])
+				break;
+			memset(blocks[i], 0, PAGE_SIZE << order);
+		}
+		if (i == n) {
+			data[s_pos] = blocks;
+			(*orders)[s_pos] = order;
+			goto done;
+		}
+		while (i--) /* give it all back, and retry smaller */
+			scull_pages_free(pp, blocks[i], order);
+		kfree(blocks);
+	}
+	return -ENOMEM;
+
+  done:
+	pp->order_hist[order]++;
+	return 0;
+}
+
+/*
+ * Release quantum "s_pos", however it was allocated.
+ */
+static inline void scull_pages_free_quantum(struct scull_pages *pp,
+		int devorder, void **data, unsigned char *orders, int s_pos)
+{
+	int order = orders ? orders[s_pos] : devorder;
+	void **blocks;
+	int i;
+
+	if (order == devorder) {
+		scull_pages_free(pp, data[s_pos], order);
+		return;
+	}
+	blocks = data[s_pos];
+	for (i = 0; i < 1 << (devorder - order); i++)
+		scull_pages_free(pp, blocks[i], order);
+	kfree(blocks);
+}
+
+/*
+ * Return the address of byte "q_pos" in quantum "s_pos", and in
+ * *avail how many bytes are contiguous from there. The quantum must
+ * be present.
+ */
+static inline void *scull_pages_ptr(int devorder, void **data,
+		unsigned char *orders, int s_pos, int q_pos, int *avail)
+{
+	int order = orders ? orders[s_pos] : devorder;
+	int blocksize = PAGE_SIZE << order;
+	void *block = data[s_pos];
+
+	if (order != devorder)
+		block = ((void **) block)[q_pos / blocksize];
+	q_pos %= blocksize;
+	*avail = blocksize - q_pos;
+	return block + q_pos;
+}
+
+/*
+ * The device has been trimmed: the histogram starts again. The node
+ * counters are back to zero by themselves.
+ */
+static inline void scull_pages_trim(struct scull_pages *pp)
+{
+	memset(pp->order_hist, 0, sizeof(pp->order_hist));
+}
+
+/*
+ * The per-node and per-order lines of the /proc dumps.
+ */
+static inline int scull_pages_proc(struct scull_pages *pp, char *buf)
+{
+	int n, len = 0;
+
+	for_each_online_node(n)
+		if (pp->node_pages[n])
+			len += sprintf(buf+len,"  node %i: %lu pages\n",
+					n, pp->node_pages[n]);
+	for (n = 0; n < SCULL_NR_ORDERS; n++)
+		if (pp->order_hist[n])
+			len += sprintf(buf+len,"  order %i: %llu quanta\n",
+					n, (unsigned long long) pp->order_hist[n]);
+	return len;
+}
+
+#endif /* _SCULLPAGES_H_ */
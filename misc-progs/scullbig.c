@@ -0,0 +1,143 @@
+/*
+ * scullbig.c -- exercise scull at offsets beyond 4GB, on far apart minors
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * Usage: scullbig major minor [minor...]
+ *
+ * For each minor, a node is made in /tmp, and a tagged block is written
+ * around each of the positions where 32-bit arithmetic goes wrong, then
+ * read back. Only the blocks take memory (and the list items up to the
+ * last one), so this runs fine with the default quantum; load scull
+ * with a quantum of a few MB and scull_nr_devs large enough for the
+ * minors to try the other corners. The devices are trimmed at the end.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define BLOCK 8192
+
+static long long positions[] = {
+	0,
+	(1LL << 31) - BLOCK / 2,	/* across a signed int */
+	(1LL << 32) - BLOCK / 2,	/* across an unsigned long, on 32 bits */
+	(1LL << 32) + 12345,
+	(5LL << 30) + 1,		/* past 4GB, unaligned */
+};
+#define NPOS (sizeof(positions) / sizeof(positions[0]))
+
+static unsigned char wbuf[BLOCK], rbuf[BLOCK];
+
+static void fill(unsigned char *buf, int minor, long long pos)
+{
+	int i;
+
+	for (i = 0; i < BLOCK; i++)
+		buf[i] = (pos + i) * 31 + minor;
+}
+
+/* scull transfers at most a quantum at a time: loop as cat(1) would */
+static int xfer(int fd, unsigned char *buf, long long pos, int write)
+{
+	int done, n;
+
+	for (done = 0; done < BLOCK; done += n) {
+		if (write)
+			n = pwrite(fd, buf + done, BLOCK - done, pos + done);
+		else
+			n = pread(fd, buf + done, BLOCK - done, pos + done);
+		if (n <= 0) {
+			fprintf(stderr, "%s at %lld: %s\n", write ? "write" : "read",
+					pos + done, n ? strerror(errno) : "end of file");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_minor(int major, int minor)
+{
+	char name[64];
+	long long end = 0, size;
+	int fd, i, errors = 0;
+
+	snprintf(name, sizeof(name), "/tmp/scullbig.%i", minor);
+	unlink(name);
+	if (mknod(name, S_IFCHR | 0600, makedev(major, minor)) < 0) {
+		perror(name);
+		return 1;
+	}
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		perror(name);
+		unlink(name);
+		return 1;
+	}
+	for (i = 0; i < NPOS; i++) {
+		fill(wbuf, minor, positions[i]);
+		if (xfer(fd, wbuf, positions[i], 1))
+			errors++;
+		if (positions[i] + BLOCK > end)
+			end = positions[i] + BLOCK;
+	}
+	for (i = 0; i < NPOS; i++) {
+		fill(wbuf, minor, positions[i]);
+		if (xfer(fd, rbuf, positions[i], 0))
+			errors++;
+		else if (memcmp(wbuf, rbuf, BLOCK)) {
+			fprintf(stderr, "minor %i: data differs at %lld\n", minor,
+					positions[i]);
+			errors++;
+		}
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size != end) {
+		fprintf(stderr, "minor %i: size is %lld, not %lld\n", minor,
+				size, end);
+		errors++;
+	}
+	close(fd);
+
+	/* a write-only open trims the device */
+	fd = open(name, O_WRONLY);
+	if (fd >= 0)
+		close(fd);
+	unlink(name);
+	printf("minor %i: %s\n", minor, errors ? "FAILED" : "ok");
+	return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, major, failed = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s major minor [minor...]\n", argv[0]);
+		exit(2);
+	}
+	major = atoi(argv[1]);
+	for (i = 2; i < argc; i++)
+		failed += test_minor(major, atoi(argv[i]));
+	exit(failed ? 1 : 0);
+}
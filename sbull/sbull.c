@@ -16,11 +16,27 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
 #include <linux/kdev_t.h>
-#include <linux/vmalloc.h>
+#include <linux/highmem.h>	/* kmap_atomic() */
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>	/* div64_u64() */
+#include <linux/device.h>	/* sysfs attributes */
+#include <linux/bitops.h>	/* fls64() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+#include <linux/kthread.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -28,10 +44,24 @@ static int sbull_major = 0;
 module_param(sbull_major, int, 0);
 static int hardsect_size = 512;
 module_param(hardsect_size, int, 0);
-static int nsectors = 1024;	/* How big the drive is */
-module_param(nsectors, int, 0);
+static unsigned long nsectors = 1024;	/* How big the drive is */
+module_param(nsectors, ulong, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
+static int xip = 0;		/* Let filesystems map our memory directly */
+module_param(xip, int, 0);
+
+/*
+ * Emulation of a slower device; each disk can be changed in sysfs.
+ */
+static int service_us = 0;	/* Access time of every request */
+module_param(service_us, int, 0);
+static int bandwidth = 0;	/* Transfer rate in KB/s; 0 is infinite */
+module_param(bandwidth, int, 0);
+static int max_depth = 32;	/* Requests the "hardware" can hold */
+module_param(max_depth, int, 0);
+static int cache_size = 0;	/* Write-back cache per disk, in KB */
+module_param(cache_size, int, 0);
 
 /*
  * The different "request modes" we can use.
@@ -40,9 +70,12 @@ enum {
 	RM_SIMPLE  = 0,	/* The extra-simple request function */
 	RM_FULL    = 1,	/* The full-blown version */
 	RM_NOQUEUE = 2,	/* Use make_request */
+	RM_MULTI   = 3,	/* One queue per CPU */
 };
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
+static int queue_depth = 64;	/* Bios in flight per CPU, for RM_MULTI */
+module_param(queue_depth, int, 0);
 
 /*
  * Minor number and partition management.
@@ -57,44 +90,914 @@ module_param(request_mode, int, 0);
  */
 #define KERNEL_SECTOR_SIZE	512
 
+/*
+ * The largest transfer we accept, in kernel sectors (16MB).
+ */
+#define SBULL_MAX_SECTORS	32768
+
 /*
  * After this much idle time, the driver will simulate a media change.
  */
 #define INVALIDATE_DELAY	30*HZ
 
+/*
+ * With RM_MULTI every CPU gets a queue of its own: bios go on the
+ * queue of the CPU that submits them, and a worker bound to that CPU
+ * does the transfers. Submitters never meet on dev->lock, so the
+ * device scales with the number of processors. This is as close as
+ * we get to blk-mq: the per-CPU queues are the hardware contexts,
+ * and queue_depth plays the part of the tag set.
+ */
+struct sbull_hwq {
+	spinlock_t lock;		/* Protects bios and tail */
+	struct bio_list bios;		/* Waiting for the worker */
+	s64 *stamps;			/* When they came, a ring of queue_depth */
+	unsigned int head, tail;
+	atomic_t depth;			/* Queued and not yet completed */
+	wait_queue_head_t wait;		/* For a free slot */
+	struct work_struct work;
+	struct sbull_dev *dev;
+	int cpu;
+};
+
+static struct workqueue_struct *sbull_wq;
+
+/*
+ * Statistics: for every kind of operation, log2 histograms of the
+ * request sizes, of the time requests wait before we start on them,
+ * and of the time we take to complete them.
+ */
+enum {
+	SBULL_OP_READ,
+	SBULL_OP_WRITE,
+	SBULL_OP_FLUSH,
+	SBULL_OP_DISCARD,
+	SBULL_NR_OPS
+};
+
+enum {
+	SBULL_H_SIZE,
+	SBULL_H_QUEUE,
+	SBULL_H_SERVICE,
+	SBULL_NR_HISTS
+};
+
+#define SBULL_BUCKETS	40	/* Up to 2^39 bytes or ns */
+
+struct sbull_stats {
+	unsigned long count[SBULL_NR_OPS][SBULL_NR_HISTS][SBULL_BUCKETS];
+};
+
+struct sbull_stat_file {
+	struct sbull_dev *dev;
+	int op;
+};
+
+static struct dentry *sbull_debug_dir;
+
+/*
+ * A request (or bio) the emulated hardware is working on.
+ */
+struct sbull_cmd {
+	struct list_head list;
+	s64 done;			/* When it completes, in ns */
+	struct request *req;		/* One of these two */
+	struct bio *bio;
+	int error;
+	int op;				/* For the statistics */
+	unsigned int bytes;
+	s64 arrive, start;
+};
+
 /*
  * The internal representation of our device.
  */
 struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
+        u64 size;                       /* Device size in bytes */
+        struct radix_tree_root pages;   /* The data, by page index */
+        spinlock_t pages_lock;          /* For inserting into pages */
+        gfp_t gfp;                      /* How to allocate pages */
         short users;                    /* How many users */
         short media_change;             /* Flag a media change? */
         spinlock_t lock;                /* For mutual exclusion */
         struct request_queue *queue;    /* The device request queue */
         struct gendisk *gd;             /* The gendisk structure */
         struct timer_list timer;        /* For simulated media changes */
+        struct sbull_hwq __percpu *hwq; /* The RM_MULTI queues */
+        unsigned int service_us;        /* The emulated device... */
+        unsigned int bandwidth;
+        unsigned int max_depth;
+        spinlock_t cmd_lock;            /* Protects the following */
+        struct sbull_cmd *cmds;         /* All of them, max_depth at load */
+        unsigned int nr_cmds;
+        struct list_head free_cmds;
+        struct list_head busy_cmds;     /* In order of completion */
+        unsigned int in_flight;
+        s64 channel_free;               /* When the transfers in flight end */
+        struct hrtimer done_timer;      /* Completes busy_cmds */
+        wait_queue_head_t cmd_wait;     /* For a free command */
+        unsigned long cache_max;        /* Write-back cache size, in pages */
+        unsigned long cache_pages;      /* How many are dirty */
+        struct radix_tree_root cache;   /* The dirty pages, by index */
+        spinlock_t cache_lock;          /* For the cache, and I/O through it */
+        struct task_struct *wb_thread;  /* Writes the cache back */
+        wait_queue_head_t wb_wait;      /* Where it sleeps */
+        struct sbull_stats __percpu *stats;
+        struct sbull_stat_file stat_files[SBULL_NR_OPS];
+        struct dentry *debug_dir;       /* Where they are shown */
 };
 
 static struct sbull_dev *Devices = NULL;
 
+/*
+ * The data lives in pages that are allocated the first time they are
+ * written, so the memory we use follows what has been stored rather
+ * than the size of the disk. Pages never written read back as zeros.
+ * Lookups only need RCU; insertions and discards take pages_lock.
+ * A discard may free a page while a transfer is copying to or from
+ * it, so transfers use their pages inside rcu_read_lock(), and the
+ * discarded pages are freed after a grace period.
+ */
+static struct page *sbull_lookup_page(struct sbull_dev *dev, pgoff_t idx)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&dev->pages, idx);
+	rcu_read_unlock();
+	return page;
+}
+
+static struct page *sbull_insert_page(struct sbull_dev *dev, pgoff_t idx,
+		gfp_t gfp)
+{
+	struct page *page;
+
+	page = sbull_lookup_page(dev, idx);
+	if (page)
+		return page;
+	/* Pages handed out by sbull_direct_access() need an address */
+	page = alloc_page(gfp | (xip ? 0 : __GFP_HIGHMEM) | __GFP_ZERO);
+	if (page == NULL)
+		return NULL;
+	if (radix_tree_preload(gfp)) {
+		__free_page(page);
+		return NULL;
+	}
+	page->index = idx;
+	spin_lock(&dev->pages_lock);
+	if (radix_tree_insert(&dev->pages, idx, page)) {
+		/* Somebody beat us to it */
+		__free_page(page);
+		page = radix_tree_lookup(&dev->pages, idx);
+	}
+	spin_unlock(&dev->pages_lock);
+	radix_tree_preload_end();
+	return page;
+}
+
+/*
+ * Drop all the data; there must be no I/O going on.
+ */
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	struct page *pages[16];
+	pgoff_t idx = 0;
+	int i, n;
+
+	spin_lock(&dev->pages_lock);
+	do {
+		n = radix_tree_gang_lookup(&dev->pages, (void **) pages, idx,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n; i++) {
+			idx = pages[i]->index;
+			radix_tree_delete(&dev->pages, idx);
+			__free_page(pages[i]);
+		}
+		idx++;
+	} while (n == ARRAY_SIZE(pages));
+	spin_unlock(&dev->pages_lock);
+}
+
+/*
+ * The write-back cache. Like the one on a real disk, it holds written
+ * data the "media" (our pages) doesn't have yet, and loses it if the
+ * power goes: a media change, or a write to cache_drop in sysfs. A
+ * thread writes it back every second, or as soon as it is half full;
+ * REQ_FLUSH writes it all back before we go on, and REQ_FUA writes
+ * go through to the media. Once the cache is on, all I/O takes
+ * cache_lock, so the cache and the pages under it always agree;
+ * without it, nothing changes.
+ */
+static int sbull_cache_clean(struct sbull_dev *dev, struct page *cpage)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&dev->pages, cpage->index);
+	if (page)
+		copy_highpage(page, cpage);
+	rcu_read_unlock();
+	if (page == NULL)
+		return -EAGAIN; /* Discarded, make a new one */
+	radix_tree_delete(&dev->cache, cpage->index);
+	dev->cache_pages--;
+	__free_page(cpage);
+	return 0;
+}
+
+/*
+ * Write back the dirty pages from first to last, counting the bytes.
+ * This may be the whole cache, so we must be able to sleep: the request
+ * functions drop the queue lock first, see sbull_rq_flush().
+ */
+static int sbull_cache_writeback(struct sbull_dev *dev, pgoff_t first,
+		pgoff_t last, u64 *bytes)
+{
+	struct page *pages[16];
+	pgoff_t idx = first;
+	int i, n, again;
+
+	while (idx <= last) {
+		again = 0;
+		spin_lock(&dev->cache_lock);
+		n = radix_tree_gang_lookup(&dev->cache, (void **) pages, idx,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n && pages[i]->index <= last; i++) {
+			idx = pages[i]->index;
+			again = sbull_cache_clean(dev, pages[i]);
+			if (again)
+				break;
+			if (bytes)
+				*bytes += PAGE_SIZE;
+		}
+		spin_unlock(&dev->cache_lock);
+		if (again) {
+			if (!sbull_insert_page(dev, idx, GFP_NOIO))
+				return -ENOMEM;
+			continue;
+		}
+		if (i < ARRAY_SIZE(pages))
+			break;
+		idx++;
+		cond_resched();
+	}
+	return 0;
+}
+
+static int sbull_cache_flush(struct sbull_dev *dev, u64 *bytes)
+{
+	if (dev->cache_max == 0)
+		return 0;
+	return sbull_cache_writeback(dev, 0, ~0UL, bytes);
+}
+
+/*
+ * Lose whatever is in the cache.
+ */
+static void sbull_cache_drop(struct sbull_dev *dev)
+{
+	struct page *pages[16];
+	int i, n;
+
+	spin_lock(&dev->cache_lock);
+	do {
+		n = radix_tree_gang_lookup(&dev->cache, (void **) pages, 0,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n; i++) {
+			radix_tree_delete(&dev->cache, pages[i]->index);
+			__free_page(pages[i]);
+		}
+		dev->cache_pages -= n;
+	} while (n);
+	spin_unlock(&dev->cache_lock);
+}
+
+/*
+ * Discarding goes for the cache too.
+ */
+static void sbull_cache_discard(struct sbull_dev *dev, u64 offset, u64 end)
+{
+	struct page *pages[16];
+	pgoff_t idx = offset >> PAGE_SHIFT, last = (end - 1) >> PAGE_SHIFT;
+	u64 pstart, from, to;
+	int i, n;
+
+	spin_lock(&dev->cache_lock);
+	while (idx <= last) {
+		n = radix_tree_gang_lookup(&dev->cache, (void **) pages, idx,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n && pages[i]->index <= last; i++) {
+			idx = pages[i]->index + 1;
+			pstart = (u64) pages[i]->index << PAGE_SHIFT;
+			from = max(offset, pstart);
+			to = min(end, pstart + PAGE_SIZE);
+			if (to - from == PAGE_SIZE) {
+				radix_tree_delete(&dev->cache, pages[i]->index);
+				__free_page(pages[i]);
+				dev->cache_pages--;
+			} else
+				zero_user(pages[i], from - pstart, to - from);
+		}
+		if (i < ARRAY_SIZE(pages))
+			break;
+	}
+	spin_unlock(&dev->cache_lock);
+}
+
+/*
+ * Move a piece of a page through the cache. "spare" is a page for a
+ * new cache entry, if the caller could get one. -EAGAIN means the
+ * page under the cache was discarded while we weren't looking.
+ */
+static int sbull_cache_transfer(struct sbull_dev *dev, u64 offset,
+		unsigned int chunk, char *buffer, int write, int fua,
+		struct page **spare)
+{
+	pgoff_t idx = offset >> PAGE_SHIFT;
+	unsigned int pgoff = offset & ~PAGE_MASK;
+	struct page *cpage, *page;
+	void *mem;
+	int ret = 0;
+
+	spin_lock(&dev->cache_lock);
+	rcu_read_lock();
+	cpage = radix_tree_lookup(&dev->cache, idx);
+	page = radix_tree_lookup(&dev->pages, idx);
+	if (!write) {
+		if (cpage || page) {
+			mem = kmap_atomic(cpage ? cpage : page, KM_USER1);
+			memcpy(buffer, mem + pgoff, chunk);
+			kunmap_atomic(mem, KM_USER1);
+		} else
+			memset(buffer, 0, chunk); /* A hole */
+		goto out;
+	}
+
+	if (cpage == NULL && !fua && *spare &&
+			dev->cache_pages < dev->cache_max) {
+		/* A new dirty page, starting from what the media has */
+		if (page)
+			copy_highpage(*spare, page);
+		if (radix_tree_insert(&dev->cache, idx, *spare) == 0) {
+			cpage = *spare;
+			cpage->index = idx;
+			*spare = NULL;
+			if (++dev->cache_pages > dev->cache_max/2)
+				wake_up(&dev->wb_wait);
+		}
+	}
+	if (page == NULL && (cpage == NULL || fua)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	mem = kmap_atomic(cpage ? cpage : page, KM_USER1);
+	memcpy(mem + pgoff, buffer, chunk);
+	kunmap_atomic(mem, KM_USER1);
+	if (cpage && fua)
+		sbull_cache_clean(dev, cpage); /* Can't fail, we have page */
+	else if (cpage == NULL && !fua)
+		wake_up(&dev->wb_wait); /* We're full */
+  out:
+	rcu_read_unlock();
+	spin_unlock(&dev->cache_lock);
+	return ret;
+}
+
+static int sbull_wb_thread(void *data)
+{
+	struct sbull_dev *dev = data;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(dev->wb_wait,
+				kthread_should_stop() ||
+				ACCESS_ONCE(dev->cache_pages) > dev->cache_max/2,
+				HZ);
+		sbull_cache_flush(dev, NULL);
+	}
+	return 0;
+}
+
+
+struct sbull_free_batch {
+	struct rcu_head rcu;
+	struct list_head pages;
+};
+
+static void sbull_free_batch_rcu(struct rcu_head *head)
+{
+	struct sbull_free_batch *batch;
+	struct page *page, *next;
+
+	batch = container_of(head, struct sbull_free_batch, rcu);
+	list_for_each_entry_safe(page, next, &batch->pages, lru)
+		__free_page(page);
+	kfree(batch);
+}
+
+/*
+ * Discard a range: the whole pages in it go back to the system, the
+ * pieces of pages at either end are zeroed. If we can't get a batch
+ * to free the pages with, we zero them too; the result reads the same.
+ * With xip, a filesystem may have the pages mapped into some process,
+ * so they are always zeroed and kept.
+ */
+static int sbull_discard(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect)
+{
+	u64 offset = (u64) sector*KERNEL_SECTOR_SIZE;
+	u64 end = offset + (u64) nsect*KERNEL_SECTOR_SIZE;
+	pgoff_t idx, stop = end >> PAGE_SHIFT;
+	struct sbull_free_batch *batch;
+	struct page *pages[16];
+	unsigned int pgoff, chunk;
+	int i, n;
+
+	if (end > dev->size)
+		return -EIO;
+	if (dev->cache_max && end > offset)
+		sbull_cache_discard(dev, offset, end);
+	batch = xip ? NULL : kmalloc(sizeof(*batch), GFP_ATOMIC);
+	if (batch)
+		INIT_LIST_HEAD(&batch->pages);
+
+	spin_lock(&dev->pages_lock);
+	/* The partial page at the start, or the whole range if it is small */
+	pgoff = offset & ~PAGE_MASK;
+	if (pgoff || end - offset < PAGE_SIZE) {
+		chunk = min_t(u64, end - offset, PAGE_SIZE - pgoff);
+		pages[0] = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+		if (pages[0])
+			zero_user(pages[0], pgoff, chunk);
+		offset += chunk;
+	}
+	/* The partial page at the end */
+	if (offset < end && (end & ~PAGE_MASK)) {
+		pages[0] = radix_tree_lookup(&dev->pages, stop);
+		if (pages[0])
+			zero_user(pages[0], 0, end & ~PAGE_MASK);
+	}
+	/* And the whole pages in between, skipping the holes */
+	idx = offset >> PAGE_SHIFT;
+	while (idx < stop) {
+		n = radix_tree_gang_lookup(&dev->pages, (void **) pages, idx,
+				ARRAY_SIZE(pages));
+		for (i = 0; i < n && pages[i]->index < stop; i++) {
+			if (batch) {
+				radix_tree_delete(&dev->pages, pages[i]->index);
+				list_add(&pages[i]->lru, &batch->pages);
+			} else
+				clear_highpage(pages[i]);
+		}
+		if (i < ARRAY_SIZE(pages))
+			break;
+		idx = pages[i - 1]->index + 1;
+	}
+	spin_unlock(&dev->pages_lock);
+
+	if (batch)
+		call_rcu(&batch->rcu, sbull_free_batch_rcu);
+	return 0;
+}
+
 /*
  * Handle an I/O request.
  */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
-		unsigned long nsect, char *buffer, int write)
+static int sbull_transfer(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect, char *buffer, int write, int fua)
 {
-	unsigned long offset = sector*KERNEL_SECTOR_SIZE;
+	u64 offset = (u64) sector*KERNEL_SECTOR_SIZE;
 	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
+	unsigned int pgoff, chunk;
+	struct page *page, *spare = NULL;
+	void *mem;
+	int ret = 0;
 
 	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
+		printk (KERN_NOTICE "Beyond-end write (%llu %ld)\n",
+				(unsigned long long) offset, nbytes);
+		return -EIO;
+	}
+	while (nbytes) {
+		pgoff = offset & ~PAGE_MASK;
+		chunk = min_t(unsigned long, nbytes, PAGE_SIZE - pgoff);
+		if (write && !sbull_insert_page(dev, offset >> PAGE_SHIFT, dev->gfp)) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (dev->cache_max) {
+			if (write && !fua && spare == NULL &&
+					ACCESS_ONCE(dev->cache_pages) < dev->cache_max)
+				spare = alloc_page(dev->gfp | __GFP_HIGHMEM | __GFP_ZERO);
+			if (sbull_cache_transfer(dev, offset, chunk, buffer, write,
+					fua, &spare))
+				continue; /* Discarded under us; try again */
+			goto next;
+		}
+		rcu_read_lock();
+		page = radix_tree_lookup(&dev->pages, offset >> PAGE_SHIFT);
+		if (page) {
+			mem = kmap_atomic(page, KM_USER1);
+			if (write)
+				memcpy(mem + pgoff, buffer, chunk);
+			else
+				memcpy(buffer, mem + pgoff, chunk);
+			kunmap_atomic(mem, KM_USER1);
+		} else if (write) {
+			rcu_read_unlock();
+			continue; /* Discarded under us; try again */
+		} else
+			memset(buffer, 0, chunk); /* A hole */
+		rcu_read_unlock();
+	  next:
+		buffer += chunk;
+		offset += chunk;
+		nbytes -= chunk;
+	}
+	if (spare)
+		__free_page(spare);
+	return ret;
+}
+
+/*
+ * Statistics are kept per CPU, so counting costs no locks or shared
+ * cache lines; they are only added up when somebody looks. They are
+ * in debugfs, one file per operation in sbull/<disk>/. Each line is
+ * a bucket, bytes for the size and nanoseconds for the times; writing
+ * to a file clears it.
+ */
+static const char *sbull_op_names[SBULL_NR_OPS] = {
+	[SBULL_OP_READ]    = "read",
+	[SBULL_OP_WRITE]   = "write",
+	[SBULL_OP_FLUSH]   = "flush",
+	[SBULL_OP_DISCARD] = "discard",
+};
+
+static inline s64 sbull_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static int sbull_op(unsigned long rw, unsigned int bytes)
+{
+	if (rw & REQ_DISCARD)
+		return SBULL_OP_DISCARD;
+	if ((rw & REQ_FLUSH) && !bytes)
+		return SBULL_OP_FLUSH;
+	return (rw & REQ_WRITE) ? SBULL_OP_WRITE : SBULL_OP_READ;
+}
+
+static inline int sbull_bucket(s64 val)
+{
+	int bucket = val > 0 ? fls64(val) : 0;
+
+	return min(bucket, SBULL_BUCKETS - 1);
+}
+
+static void sbull_account(struct sbull_dev *dev, int op, unsigned int bytes,
+		s64 arrive, s64 start, s64 end)
+{
+	this_cpu_inc(dev->stats->count[op][SBULL_H_SIZE][sbull_bucket(bytes)]);
+	this_cpu_inc(dev->stats->count[op][SBULL_H_QUEUE][sbull_bucket(start - arrive)]);
+	this_cpu_inc(dev->stats->count[op][SBULL_H_SERVICE][sbull_bucket(end - start)]);
+}
+
+/*
+ * The block layer stamps requests in jiffies, so for the request
+ * functions the time in the queue is only as good as that.
+ */
+static s64 sbull_rq_arrival(struct request *req, s64 now)
+{
+	return now - (s64) jiffies_to_usecs(jiffies - req->start_time)*NSEC_PER_USEC;
+}
+
+static int sbull_stats_show(struct seq_file *s, void *v)
+{
+	struct sbull_stat_file *file = s->private;
+	struct sbull_stats *stats;
+	unsigned long n[SBULL_NR_HISTS];
+	int i, h, cpu;
+
+	seq_printf(s, "%12s %12s %10s %10s %10s\n", "from", "to", "size",
+			"queue", "service");
+	for (i = 0; i < SBULL_BUCKETS; i++) {
+		memset(n, 0, sizeof(n));
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(file->dev->stats, cpu);
+			for (h = 0; h < SBULL_NR_HISTS; h++)
+				n[h] += stats->count[file->op][h][i];
+		}
+		if (n[SBULL_H_SIZE] || n[SBULL_H_QUEUE] || n[SBULL_H_SERVICE])
+			seq_printf(s, "%12llu %12llu %10lu %10lu %10lu\n",
+					i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+					n[SBULL_H_SIZE], n[SBULL_H_QUEUE],
+					n[SBULL_H_SERVICE]);
+	}
+	return 0;
+}
+
+static int sbull_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, sbull_stats_show, inode->i_private);
+}
+
+static ssize_t sbull_stats_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct sbull_stat_file *file = ((struct seq_file *)filp->private_data)->private;
+	struct sbull_stats *stats;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(file->dev->stats, cpu);
+		memset(stats->count[file->op], 0, sizeof(stats->count[file->op]));
+	}
+	return count;
+}
+
+static struct file_operations sbull_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = sbull_stats_open,
+	.read    = seq_read,
+	.write   = sbull_stats_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Without debugfs we still count; there's just no way to look.
+ */
+static void sbull_stats_files(struct sbull_dev *dev)
+{
+	int op;
+
+	if (sbull_debug_dir == NULL)
+		return;
+	dev->debug_dir = debugfs_create_dir(dev->gd->disk_name, sbull_debug_dir);
+	if (IS_ERR_OR_NULL(dev->debug_dir)) {
+		dev->debug_dir = NULL;
 		return;
 	}
-	if (write)
-		memcpy(dev->data + offset, buffer, nbytes);
+	for (op = 0; op < SBULL_NR_OPS; op++) {
+		dev->stat_files[op].dev = dev;
+		dev->stat_files[op].op = op;
+		debugfs_create_file(sbull_op_names[op], S_IRUSR | S_IWUSR,
+				dev->debug_dir, dev->stat_files + op,
+				&sbull_stats_fops);
+	}
+}
+
+
+/*
+ * Emulating a slower device. Every request costs service_us, which
+ * requests in flight pay at the same time, plus the time to move its
+ * data at bandwidth, which they pay one after the other. The data is
+ * copied right away; only the completion waits, in an hrtimer. At most
+ * max_depth requests are in flight: the request functions leave the
+ * others in the queue, for the I/O scheduler to play with, and the
+ * make_request functions wait. The simple request function does not
+ * take part in this, to stay simple.
+ */
+static int sbull_emulating(struct sbull_dev *dev)
+{
+	return ACCESS_ONCE(dev->service_us) || ACCESS_ONCE(dev->bandwidth);
+}
+
+static struct sbull_cmd *sbull_get_cmd(struct sbull_dev *dev)
+{
+	struct sbull_cmd *cmd = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->cmd_lock, flags);
+	if (dev->in_flight < dev->max_depth && !list_empty(&dev->free_cmds)) {
+		cmd = list_first_entry(&dev->free_cmds, struct sbull_cmd, list);
+		list_del(&cmd->list);
+		dev->in_flight++;
+	}
+	spin_unlock_irqrestore(&dev->cmd_lock, flags);
+	return cmd;
+}
+
+/*
+ * With the write-back cache on, a write the cache takes costs only its
+ * transfer, no access time; a flush costs an access plus the transfer
+ * of what it writes back.
+ */
+static int sbull_cached(struct sbull_dev *dev, int op, unsigned long rw)
+{
+	return dev->cache_max && op == SBULL_OP_WRITE &&
+		!(rw & (REQ_FUA | REQ_FLUSH));
+}
+
+static void sbull_start_cmd(struct sbull_dev *dev, struct sbull_cmd *cmd,
+		u64 bytes, int access)
+{
+	s64 now = ktime_to_ns(ktime_get());
+	unsigned int bw = ACCESS_ONCE(dev->bandwidth);
+	u64 xfer = 0;
+	unsigned long flags;
+
+	if (bw)
+		xfer = div64_u64(bytes*NSEC_PER_SEC, (u64) bw*1024);
+	spin_lock_irqsave(&dev->cmd_lock, flags);
+	dev->channel_free = max(dev->channel_free, now) + xfer;
+	cmd->done = dev->channel_free;
+	if (access)
+		cmd->done += (s64) ACCESS_ONCE(dev->service_us)*NSEC_PER_USEC;
+	list_add_tail(&cmd->list, &dev->busy_cmds);
+	if (dev->busy_cmds.next == &cmd->list) /* The timer is idle */
+		hrtimer_start(&dev->done_timer, ns_to_ktime(cmd->done),
+				HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&dev->cmd_lock, flags);
+}
+
+static enum hrtimer_restart sbull_cmd_timer(struct hrtimer *timer)
+{
+	struct sbull_dev *dev = container_of(timer, struct sbull_dev, done_timer);
+	s64 now = ktime_to_ns(ktime_get());
+	struct sbull_cmd *cmd, *next;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned int n = 0;
+	LIST_HEAD(done);
+
+	spin_lock(&dev->cmd_lock);
+	list_for_each_entry_safe(cmd, next, &dev->busy_cmds, list) {
+		if (cmd->done > now)
+			break;
+		list_move_tail(&cmd->list, &done);
+	}
+	if (!list_empty(&dev->busy_cmds)) {
+		cmd = list_first_entry(&dev->busy_cmds, struct sbull_cmd, list);
+		hrtimer_set_expires(timer, ns_to_ktime(cmd->done));
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock(&dev->cmd_lock);
+
+	list_for_each_entry(cmd, &done, list) {
+		sbull_account(dev, cmd->op, cmd->bytes, cmd->arrive, cmd->start, now);
+		if (cmd->req)
+			blk_end_request_all(cmd->req, cmd->error);
+		else
+			bio_endio(cmd->bio, cmd->error);
+		n++;
+	}
+
+	spin_lock(&dev->cmd_lock);
+	list_splice(&done, &dev->free_cmds);
+	dev->in_flight -= n;
+	spin_unlock(&dev->cmd_lock);
+	wake_up(&dev->cmd_wait);
+	if (request_mode == RM_FULL)
+		blk_run_queue_async(dev->queue);
+	return ret;
+}
+
+static int sbull_emul_init(struct sbull_dev *dev)
+{
+	int i;
+
+	dev->service_us = service_us;
+	dev->bandwidth = bandwidth;
+	dev->max_depth = dev->nr_cmds = max_depth;
+	dev->cmds = kcalloc(dev->nr_cmds, sizeof(struct sbull_cmd), GFP_KERNEL);
+	if (dev->cmds == NULL)
+		return -ENOMEM;
+	for (i = 0; i < dev->nr_cmds; i++)
+		list_add_tail(&dev->cmds[i].list, &dev->free_cmds);
+	return 0;
+}
+
+/*
+ * The emulation parameters, in /sys/block/sbullX.
+ */
+static ssize_t sbull_emul_show(struct device *d, struct device_attribute *attr,
+		char *buf)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+	unsigned int val;
+
+	if (!strcmp(attr->attr.name, "service_us"))
+		val = dev->service_us;
+	else if (!strcmp(attr->attr.name, "bandwidth"))
+		val = dev->bandwidth;
 	else
-		memcpy(buffer, dev->data + offset, nbytes);
+		val = dev->max_depth;
+	return sprintf(buf, "%u\n", val);
+}
+
+static ssize_t sbull_emul_store(struct device *d, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (!strcmp(attr->attr.name, "service_us"))
+		dev->service_us = val;
+	else if (!strcmp(attr->attr.name, "bandwidth"))
+		dev->bandwidth = val;
+	else {
+		if (val < 1 || val > dev->nr_cmds)
+			return -EINVAL;
+		dev->max_depth = val;
+		if (request_mode == RM_FULL)
+			blk_run_queue(dev->queue);
+		wake_up(&dev->cmd_wait);
+	}
+	return count;
+}
+
+/*
+ * How much the cache holds, in KB; writing anything to cache_drop
+ * pulls the plug on it.
+ */
+static ssize_t sbull_cache_dirty_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%lu\n", ACCESS_ONCE(dev->cache_pages) << (PAGE_SHIFT - 10));
+}
+
+static ssize_t sbull_cache_drop_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	sbull_cache_drop(dev_to_disk(d)->private_data);
+	return count;
+}
+
+static DEVICE_ATTR(service_us, S_IRUGO | S_IWUSR, sbull_emul_show, sbull_emul_store);
+static DEVICE_ATTR(bandwidth, S_IRUGO | S_IWUSR, sbull_emul_show, sbull_emul_store);
+static DEVICE_ATTR(max_depth, S_IRUGO | S_IWUSR, sbull_emul_show, sbull_emul_store);
+static DEVICE_ATTR(cache_dirty, S_IRUGO, sbull_cache_dirty_show, NULL);
+static DEVICE_ATTR(cache_drop, S_IWUSR, NULL, sbull_cache_drop_store);
+
+static struct attribute *sbull_emul_attrs[] = {
+	&dev_attr_service_us.attr,
+	&dev_attr_bandwidth.attr,
+	&dev_attr_max_depth.attr,
+	NULL,
+};
+
+static struct attribute_group sbull_emul_group = {
+	.attrs = sbull_emul_attrs,
+};
+
+/* The cache works in every request mode, so its files do too */
+static struct attribute *sbull_cache_attrs[] = {
+	&dev_attr_cache_dirty.attr,
+	&dev_attr_cache_drop.attr,
+	NULL,
+};
+
+static struct attribute_group sbull_cache_group = {
+	.attrs = sbull_cache_attrs,
+};
+
+
+/*
+ * The request functions run under the queue lock, where we can't wait
+ * for memory; so before a write, once the request is off the queue, we
+ * drop the lock and get the pages it needs the way make_request does.
+ * The transfer then finds them there, unless a discard got in between.
+ */
+static int sbull_prealloc(struct request_queue *q, struct sbull_dev *dev,
+		struct request *req)
+{
+	u64 offset = (u64) blk_rq_pos(req)*KERNEL_SECTOR_SIZE;
+	u64 end = offset + blk_rq_bytes(req);
+	pgoff_t idx;
+	int ret = 0;
+
+	if (rq_data_dir(req) != WRITE || (req->cmd_flags & REQ_DISCARD) ||
+			end == offset || end > dev->size)
+		return 0; /* Nothing to get, or the transfer will complain */
+	spin_unlock_irq(q->queue_lock);
+	for (idx = offset >> PAGE_SHIFT; idx <= (end - 1) >> PAGE_SHIFT; idx++)
+		if (!sbull_insert_page(dev, idx, GFP_NOIO)) {
+			ret = -ENOMEM;
+			break;
+		}
+	spin_lock_irq(q->queue_lock);
+	return ret;
+}
+
+/*
+ * A flush may have the whole cache to write back, which is no job for
+ * a spinlock; the request is off the queue, so we can drop it here too.
+ */
+static int sbull_rq_flush(struct request_queue *q, struct sbull_dev *dev,
+		u64 *flushed)
+{
+	int ret;
+
+	spin_unlock_irq(q->queue_lock);
+	ret = sbull_cache_flush(dev, flushed);
+	spin_lock_irq(q->queue_lock);
+	return ret;
 }
 
 /*
@@ -103,58 +1006,152 @@ static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
 static void sbull_request(struct request_queue *q)
 {
 	struct request *req;
+	int more, op = 0, error = 0;
+	unsigned int bytes = 0;
+	s64 arrive = 0, start = 0;
 
-	while ((req = blk_fetch_request(q)) != NULL) {
+	req = blk_fetch_request(q);
+	while (req != NULL) {
 		struct sbull_dev *dev = req->rq_disk->private_data;
+		if (start == 0) { /* A new one */
+			start = sbull_now();
+			arrive = sbull_rq_arrival(req, start);
+			bytes = blk_rq_bytes(req);
+			op = req->cmd_type == REQ_TYPE_FS ?
+				sbull_op(req->cmd_flags, bytes) : -1;
+			error = op >= 0 ? sbull_prealloc(q, dev, req) : 0;
+		}
 		if (req->cmd_type != REQ_TYPE_FS) {
 			printk (KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request_cur(req, -EIO);
-			continue;
-		}
+			more = __blk_end_request_cur(req, -EIO);
+		} else if (error) {
+			__blk_end_request_all(req, error);
+			more = 0;
+		} else if (req->cmd_flags & REQ_DISCARD) {
+			__blk_end_request_all(req, sbull_discard(dev,
+					blk_rq_pos(req), blk_rq_sectors(req)));
+			more = 0;
+		} else if (req->cmd_flags & REQ_FLUSH) {
+			__blk_end_request_all(req, sbull_rq_flush(q, dev, NULL));
+			more = 0;
+		} else {
     //    	printk (KERN_NOTICE "Req dev %d dir %ld sec %ld, nr %d f %lx\n",
     //    			dev - Devices, rq_data_dir(req),
     //    			req->sector, req->current_nr_sectors,
     //    			req->flags);
-		sbull_transfer(dev, blk_rq_pos(req), blk_rq_cur_sectors(req),
-				req->buffer, rq_data_dir(req));
-		__blk_end_request_cur(req, 0);
+			more = __blk_end_request_cur(req, sbull_transfer(dev,
+					blk_rq_pos(req), blk_rq_cur_sectors(req),
+					req->buffer, rq_data_dir(req),
+					(req->cmd_flags & REQ_FUA) != 0));
+		}
+		/* The rest of a partly done request comes first */
+		if (more)
+			continue;
+		if (op >= 0) /* req is gone, but we know what it was */
+			sbull_account(dev, op, bytes, arrive, start, sbull_now());
+		start = 0;
+		req = blk_fetch_request(q);
 	}
 }
 
 
 /*
- * Transfer a single BIO.
+ * Segments of a bio that continue each other in memory make up a run:
+ * pieces of the same page, or lowmem pages that follow each other in
+ * the kernel mapping. Does this segment extend the run?
+ */
+static int sbull_bvec_follows(struct page *page, unsigned int offset,
+		unsigned int len, struct bio_vec *bvec)
+{
+	if (PageHighMem(page) || PageHighMem(bvec->bv_page))
+		return bvec->bv_page == page && bvec->bv_offset == offset + len;
+	return (char *) page_address(page) + offset + len ==
+		(char *) page_address(bvec->bv_page) + bvec->bv_offset;
+}
+
+/*
+ * Transfer a run with a single mapping. Writes may sleep allocating
+ * backing pages, unless we are in a request function, so highmem is
+ * mapped with kmap() when they can.
+ */
+static int sbull_xfer_run(struct sbull_dev *dev, sector_t sector,
+		struct page *page, unsigned int offset, unsigned int len,
+		int write, int fua)
+{
+	char *buffer;
+	int ret;
+
+	if (!PageHighMem(page))
+		return sbull_transfer(dev, sector, len >> 9,
+				(char *) page_address(page) + offset, write, fua);
+	if (dev->gfp & __GFP_WAIT) {
+		buffer = kmap(page);
+		ret = sbull_transfer(dev, sector, len >> 9, buffer + offset,
+				write, fua);
+		kunmap(page);
+	} else {
+		buffer = kmap_atomic(page, KM_USER0);
+		ret = sbull_transfer(dev, sector, len >> 9, buffer + offset,
+				write, fua);
+		kunmap_atomic(buffer, KM_USER0);
+	}
+	return ret;
+}
+
+/*
+ * Transfer a single BIO, a run of segments at a time.
  */
 static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 {
-	int i;
+	int i, ret;
 	struct bio_vec *bvec;
+	struct page *page = NULL;
+	unsigned int offset = 0, len = 0;
 	sector_t sector = bio->bi_sector;
+	int write = bio_data_dir(bio) == WRITE;
+	int fua = (bio->bi_rw & REQ_FUA) != 0;
 
-	/* Do each segment independently. */
+	if (bio->bi_rw & REQ_DISCARD)
+		return sbull_discard(dev, sector, bio_sectors(bio));
 	bio_for_each_segment(bvec, bio, i) {
-		char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		sbull_transfer(dev, sector, bio_cur_bytes(bio) >> 9,
-				buffer, bio_data_dir(bio) == WRITE);
-		sector += bio_cur_bytes(bio) >> 9;
-		__bio_kunmap_atomic(bio, KM_USER0);
+		if (len && sbull_bvec_follows(page, offset, len, bvec)) {
+			len += bvec->bv_len;
+			continue;
+		}
+		if (len) {
+			ret = sbull_xfer_run(dev, sector, page, offset, len,
+					write, fua);
+			if (ret)
+				return ret;
+			sector += len >> 9;
+		}
+		page = bvec->bv_page;
+		offset = bvec->bv_offset;
+		len = bvec->bv_len;
 	}
-	return 0; /* Always "succeed" */
+	if (len)
+		return sbull_xfer_run(dev, sector, page, offset, len, write, fua);
+	return 0;
 }
 
 /*
- * Transfer a full request.
+ * Transfer a full request. The block layer sends flushes as requests
+ * of their own, with no data.
  */
-static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
+static int sbull_xfer_request(struct request_queue *q, struct sbull_dev *dev,
+		struct request *req, u64 *flushed)
 {
 	struct bio *bio;
-	int nsect = 0;
-    
+	int ret;
+
+	if (req->cmd_flags & REQ_FLUSH)
+		return sbull_rq_flush(q, dev, flushed);
 	__rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
-		nsect += bio->bi_size/KERNEL_SECTOR_SIZE;
+		ret = sbull_xfer_bio(dev, bio);
+		if (ret)
+			return ret;
 	}
-	return nsect;
+	return 0;
 }
 
 
@@ -165,35 +1162,183 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 static void sbull_full_request(struct request_queue *q)
 {
 	struct request *req;
-	int sectors_xferred;
 	struct sbull_dev *dev = q->queuedata;
+	struct sbull_cmd *cmd;
+	u64 flushed;
+	s64 start;
+	int error;
 
-	while ((req = blk_fetch_request(q)) != NULL) {
+	while ((req = blk_peek_request(q)) != NULL) {
 		if (req->cmd_type != REQ_TYPE_FS) {
+			blk_start_request(req);
 			printk (KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
+			__blk_end_request_all(req, -EIO);
 			continue;
 		}
-		sectors_xferred = sbull_xfer_request(dev, req);
-		__blk_end_request(req, 0, sectors_xferred);
+		cmd = NULL;
+		if (sbull_emulating(dev)) {
+			cmd = sbull_get_cmd(dev);
+			if (cmd == NULL)
+				break; /* Full; a completion will restart us */
+		}
+		blk_start_request(req);
+		start = sbull_now();
+		flushed = 0;
+		error = sbull_prealloc(q, dev, req);
+		if (error == 0)
+			error = sbull_xfer_request(q, dev, req, &flushed);
+		if (cmd == NULL) {
+			sbull_account(dev, sbull_op(req->cmd_flags, blk_rq_bytes(req)),
+					blk_rq_bytes(req), sbull_rq_arrival(req, start),
+					start, sbull_now());
+			__blk_end_request_all(req, error);
+			continue;
+		}
+		cmd->req = req;
+		cmd->bio = NULL;
+		cmd->error = error;
+		cmd->op = sbull_op(req->cmd_flags, blk_rq_bytes(req));
+		cmd->bytes = blk_rq_bytes(req);
+		cmd->arrive = sbull_rq_arrival(req, start);
+		cmd->start = start;
+		sbull_start_cmd(dev, cmd, cmd->bytes + flushed,
+				!sbull_cached(dev, cmd->op, req->cmd_flags));
 	}
 }
 
 
 
+/*
+ * Do a bio that came at "arrive", and finish it now or when the
+ * emulated device would have.
+ */
+static void sbull_do_bio(struct sbull_dev *dev, struct bio *bio, s64 arrive)
+{
+	struct sbull_cmd *cmd = NULL;
+	int op = sbull_op(bio->bi_rw, bio->bi_size);
+	u64 flushed = 0;
+	int status = 0;
+	s64 start;
+
+	if (sbull_emulating(dev))
+		wait_event(dev->cmd_wait, (cmd = sbull_get_cmd(dev)) != NULL);
+	start = sbull_now();
+	if (bio->bi_rw & REQ_FLUSH) /* Before the data, if any */
+		status = sbull_cache_flush(dev, &flushed);
+	if (status == 0)
+		status = sbull_xfer_bio(dev, bio);
+	if (cmd == NULL) {
+		sbull_account(dev, op, bio->bi_size, arrive, start, sbull_now());
+		bio_endio(bio, status);
+		return;
+	}
+	cmd->req = NULL;
+	cmd->bio = bio;
+	cmd->error = status;
+	cmd->op = op;
+	cmd->bytes = bio->bi_size;
+	cmd->arrive = arrive;
+	cmd->start = start;
+	sbull_start_cmd(dev, cmd, cmd->bytes + flushed,
+			!sbull_cached(dev, op, bio->bi_rw));
+}
+
 /*
  * The direct make request version.
  */
 static int sbull_make_request(struct request_queue *q, struct bio *bio)
+{
+	sbull_do_bio(q->queuedata, bio, sbull_now());
+	return 0;
+}
+
+
+/*
+ * The multiqueue version: queue the bio on this CPU and let the
+ * worker handle it. We may sleep for a slot, like a driver waiting
+ * for a free tag; we may wake up on another CPU, though, so the queue
+ * is chosen again, and the slot taken and the bio queued without
+ * moving in between.
+ */
+static int sbull_mq_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct sbull_dev *dev = q->queuedata;
-	int status;
+	struct sbull_hwq *hwq;
+	s64 now = sbull_now();
 
-	status = sbull_xfer_bio(dev, bio);
-	bio_endio(bio, status);
+	for (;;) {
+		hwq = per_cpu_ptr(dev->hwq, get_cpu());
+		if (atomic_add_unless(&hwq->depth, 1, queue_depth))
+			break;
+		put_cpu();
+		wait_event(hwq->wait, atomic_read(&hwq->depth) < queue_depth);
+	}
+	spin_lock(&hwq->lock);
+	bio_list_add(&hwq->bios, bio);
+	hwq->stamps[hwq->tail++ % queue_depth] = now;
+	spin_unlock(&hwq->lock);
+	queue_work_on(hwq->cpu, sbull_wq, &hwq->work);
+	put_cpu();
 	return 0;
 }
 
+static void sbull_mq_work(struct work_struct *work)
+{
+	struct sbull_hwq *hwq = container_of(work, struct sbull_hwq, work);
+	struct bio *bio, *next;
+
+	spin_lock(&hwq->lock);
+	bio = bio_list_get(&hwq->bios);
+	spin_unlock(&hwq->lock);
+
+	/* The stamps can't be reused until we give back the slots */
+	for (; bio; bio = next) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+		sbull_do_bio(hwq->dev, bio, hwq->stamps[hwq->head++ % queue_depth]);
+		smp_mb__before_atomic_dec();
+		atomic_dec(&hwq->depth);
+		wake_up(&hwq->wait);
+	}
+}
+
+static int sbull_mq_init(struct sbull_dev *dev)
+{
+	struct sbull_hwq *hwq;
+	int cpu;
+
+	dev->hwq = alloc_percpu(struct sbull_hwq);
+	if (dev->hwq == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		hwq = per_cpu_ptr(dev->hwq, cpu);
+		spin_lock_init(&hwq->lock);
+		bio_list_init(&hwq->bios);
+		atomic_set(&hwq->depth, 0);
+		init_waitqueue_head(&hwq->wait);
+		INIT_WORK(&hwq->work, sbull_mq_work);
+		hwq->dev = dev;
+		hwq->cpu = cpu;
+		hwq->head = hwq->tail = 0;
+		hwq->stamps = kcalloc(queue_depth, sizeof(s64), GFP_KERNEL);
+		if (hwq->stamps == NULL)
+			return -ENOMEM; /* sbull_mq_cleanup() frees the rest */
+	}
+	return 0;
+}
+
+static void sbull_mq_cleanup(struct sbull_dev *dev)
+{
+	int cpu;
+
+	if (dev->hwq == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dev->hwq, cpu)->stamps);
+	free_percpu(dev->hwq);
+	dev->hwq = NULL;
+}
+
 
 /*
  * Open and close.
@@ -249,7 +1394,8 @@ int sbull_revalidate(struct gendisk *gd)
 	
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		sbull_cache_drop(dev);
+		sbull_free_pages(dev);
 	}
 	return 0;
 }
@@ -263,7 +1409,7 @@ void sbull_invalidate(unsigned long ldev)
 	struct sbull_dev *dev = (struct sbull_dev *) ldev;
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
+	if (dev->users) 
 		printk (KERN_WARNING "sbull: timer sanity check failed\n");
 	else
 		dev->media_change = 1;
@@ -304,6 +1450,31 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 
 
 
+/*
+ * Execute in place: hand a page of ours to a filesystem that wants to
+ * map it directly (ext2 mounted with -o xip, 4k blocks), with no page
+ * cache and no copies in between. We are called in process context,
+ * so we can wait for memory whatever the request mode.
+ */
+static int sbull_direct_access(struct block_device *bdev, sector_t sector,
+		void **kaddr, unsigned long *pfn)
+{
+	struct sbull_dev *dev = bdev->bd_disk->private_data;
+	struct page *page;
+
+	if (sector & (PAGE_SIZE/KERNEL_SECTOR_SIZE - 1))
+		return -EINVAL;
+	if (sector + PAGE_SIZE/KERNEL_SECTOR_SIZE > get_capacity(bdev->bd_disk))
+		return -ERANGE;
+	page = sbull_insert_page(dev, sector >> (PAGE_SHIFT - 9), GFP_NOIO);
+	if (page == NULL)
+		return -ENOSPC;
+	*kaddr = page_address(page);
+	*pfn = page_to_pfn(page);
+	return 0;
+}
+
+
 /*
  * The device operations structure.
  */
@@ -323,16 +1494,27 @@ static struct block_device_operations sbull_ops = {
 static void setup_device(struct sbull_dev *dev, int which)
 {
 	/*
-	 * Get some memory.
+	 * No memory yet: pages come as they are written.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
-		return;
-	}
+	dev->size = (u64) nsectors*hardsect_size;
+	INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
+	spin_lock_init(&dev->pages_lock);
+	INIT_RADIX_TREE(&dev->cache, GFP_ATOMIC);
+	spin_lock_init(&dev->cache_lock);
+	init_waitqueue_head(&dev->wb_wait);
 	spin_lock_init(&dev->lock);
+	spin_lock_init(&dev->cmd_lock);
+	INIT_LIST_HEAD(&dev->free_cmds);
+	INIT_LIST_HEAD(&dev->busy_cmds);
+	init_waitqueue_head(&dev->cmd_wait);
+	hrtimer_init(&dev->done_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->done_timer.function = sbull_cmd_timer;
+	/* The request functions run under the queue lock, see sbull_prealloc() */
+	if (request_mode == RM_NOQUEUE || request_mode == RM_MULTI)
+		dev->gfp = GFP_NOIO;
+	else
+		dev->gfp = GFP_ATOMIC;
 	
 	/*
 	 * The timer which "invalidates" the device.
@@ -340,6 +1522,12 @@ static void setup_device(struct sbull_dev *dev, int which)
 	init_timer(&dev->timer);
 	dev->timer.data = (unsigned long) dev;
 	dev->timer.function = sbull_invalidate;
+
+	if (request_mode != RM_SIMPLE && sbull_emul_init(dev) < 0)
+		goto out_free;
+	dev->stats = alloc_percpu(struct sbull_stats);
+	if (dev->stats == NULL)
+		goto out_free;
 	
 	/*
 	 * The I/O queue, depending on whether we are using our own
@@ -349,35 +1537,84 @@ static void setup_device(struct sbull_dev *dev, int which)
 	    case RM_NOQUEUE:
 		dev->queue = blk_alloc_queue(GFP_KERNEL);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			goto out_free;
 		blk_queue_make_request(dev->queue, sbull_make_request);
 		break;
 
+	    case RM_MULTI:
+		if (sbull_mq_init(dev) < 0)
+			goto out_free;
+		dev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (dev->queue == NULL)
+			goto out_free;
+		blk_queue_make_request(dev->queue, sbull_mq_make_request);
+		break;
+
 	    case RM_FULL:
-		dev->queue = blk_init_queue(sbull_full_request, &dev->lock);
+		/*
+		 * Emulated completions take the queue lock from an hrtimer,
+		 * so it can't be dev->lock, which open takes with interrupts
+		 * on. Let the queue use a lock of its own.
+		 */
+		dev->queue = blk_init_queue(sbull_full_request, NULL);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			goto out_free;
 		break;
 
 	    default:
 		printk(KERN_NOTICE "Bad request mode %d, using simple\n", request_mode);
+		request_mode = RM_SIMPLE;
         	/* fall into.. */
 	
 	    case RM_SIMPLE:
 		dev->queue = blk_init_queue(sbull_request, &dev->lock);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			goto out_free;
 		break;
 	}
 	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	/*
+	 * Discards give memory back, and what was discarded reads as zeros.
+	 */
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	dev->queue->limits.discard_zeroes_data = 1;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
+	/*
+	 * We have no hardware limits on transfers, so let big ones through
+	 * in one piece. Only the simple request function needs lowmem
+	 * buffers; the others map what they are given.
+	 */
+	blk_queue_max_hw_sectors(dev->queue, SBULL_MAX_SECTORS);
+	blk_queue_max_segments(dev->queue, USHRT_MAX);
+	blk_queue_max_segment_size(dev->queue, UINT_MAX);
+	if (request_mode != RM_SIMPLE)
+		blk_queue_bounce_limit(dev->queue, BLK_BOUNCE_ANY);
 	dev->queue->queuedata = dev;
+	/*
+	 * The write-back cache, if we have one, and its thread. A
+	 * filesystem that maps our pages with xip would go around it.
+	 */
+	if (cache_size > 0 && xip)
+		printk (KERN_NOTICE "sbull: no write-back cache with xip\n");
+	else if (cache_size > 0) {
+		dev->wb_thread = kthread_run(sbull_wb_thread, dev, "sbull_wb%c",
+				which + 'a');
+		if (IS_ERR(dev->wb_thread)) {
+			printk (KERN_NOTICE "sbull: no writeback thread, no cache\n");
+			dev->wb_thread = NULL;
+		} else {
+			dev->cache_max = ((unsigned long) cache_size*1024) >> PAGE_SHIFT;
+			blk_queue_flush(dev->queue, REQ_FLUSH | REQ_FUA);
+		}
+	}
 	/*
 	 * And the gendisk structure.
 	 */
 	dev->gd = alloc_disk(SBULL_MINORS);
 	if (! dev->gd) {
 		printk (KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		goto out_free;
 	}
 	dev->gd->major = sbull_major;
 	dev->gd->first_minor = which*SBULL_MINORS;
@@ -385,13 +1622,21 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
 	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
-	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
+	set_capacity(dev->gd, (sector_t) nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
 	add_disk(dev->gd);
+	if (request_mode != RM_SIMPLE && sysfs_create_group(
+			&disk_to_dev(dev->gd)->kobj, &sbull_emul_group))
+		printk (KERN_NOTICE "sbull: no emulation controls for %s\n",
+				dev->gd->disk_name);
+	if (dev->cache_max && sysfs_create_group(&disk_to_dev(dev->gd)->kobj,
+			&sbull_cache_group))
+		printk (KERN_NOTICE "sbull: no cache controls for %s\n",
+				dev->gd->disk_name);
+	sbull_stats_files(dev);
 	return;
 
-  out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+  out_free:
+	sbull_mq_cleanup(dev);
 }
 
 
@@ -402,22 +1647,45 @@ static int __init sbull_init(void)
 	/*
 	 * Get registered.
 	 */
+	if (xip)
+		sbull_ops.direct_access = sbull_direct_access;
 	sbull_major = register_blkdev(sbull_major, "sbull");
 	if (sbull_major <= 0) {
 		printk(KERN_WARNING "sbull: unable to get major number\n");
 		return -EBUSY;
 	}
+	if (max_depth < 1) {
+		printk(KERN_NOTICE "sbull: bad max depth %d, using 1\n", max_depth);
+		max_depth = 1;
+	}
+	if (queue_depth < 1) {
+		printk(KERN_NOTICE "sbull: bad queue depth %d, using 1\n",
+				queue_depth);
+		queue_depth = 1;
+	}
+	if (request_mode == RM_MULTI) {
+		sbull_wq = alloc_workqueue("sbull", WQ_MEM_RECLAIM, 0);
+		if (sbull_wq == NULL)
+			goto out_unregister;
+	}
+	sbull_debug_dir = debugfs_create_dir("sbull", NULL);
+	if (IS_ERR_OR_NULL(sbull_debug_dir))
+		sbull_debug_dir = NULL;
 	/*
 	 * Allocate the device array, and initialize each one.
 	 */
 	Devices = kmalloc(ndevices*sizeof (struct sbull_dev), GFP_KERNEL);
 	if (Devices == NULL)
-		goto out_unregister;
+		goto out_destroy;
 	for (i = 0; i < ndevices; i++) 
 		setup_device(Devices + i, i);
     
 	return 0;
 
+  out_destroy:
+	debugfs_remove_recursive(sbull_debug_dir);
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
   out_unregister:
 	unregister_blkdev(sbull_major, "sbd");
 	return -ENOMEM;
@@ -432,18 +1700,39 @@ static void sbull_exit(void)
 
 		del_timer_sync(&dev->timer);
 		if (dev->gd) {
+			if (request_mode != RM_SIMPLE)
+				sysfs_remove_group(&disk_to_dev(dev->gd)->kobj,
+						&sbull_emul_group);
+			if (dev->cache_max)
+				sysfs_remove_group(&disk_to_dev(dev->gd)->kobj,
+						&sbull_cache_group);
 			del_gendisk(dev->gd);
 			put_disk(dev->gd);
 		}
+		/* Let the last I/O finish, emulated or not */
+		if (dev->hwq)
+			flush_workqueue(sbull_wq);
+		wait_event(dev->cmd_wait, dev->in_flight == 0);
+		hrtimer_cancel(&dev->done_timer);
 		if (dev->queue) {
-			if (request_mode == RM_NOQUEUE)
+			if (request_mode == RM_NOQUEUE || request_mode == RM_MULTI)
 				kobject_put (&dev->queue->kobj);
 			else
 				blk_cleanup_queue(dev->queue);
 		}
-		if (dev->data)
-			vfree(dev->data);
+		sbull_mq_cleanup(dev);
+		kfree(dev->cmds);
+		debugfs_remove_recursive(dev->debug_dir);
+		free_percpu(dev->stats);
+		if (dev->wb_thread)
+			kthread_stop(dev->wb_thread);
+		sbull_cache_drop(dev);
+		sbull_free_pages(dev);
 	}
+	if (sbull_wq)
+		destroy_workqueue(sbull_wq);
+	rcu_barrier();	/* Discarded pages still waiting to be freed */
+	debugfs_remove_recursive(sbull_debug_dir);
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
 }
@@ -261,6 +261,11 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
+	lptr->device.alloc = scull_alloc;
+	init_rwsem(&(lptr->device.append_sem));
+	INIT_LIST_HEAD(&(lptr->device.appends));
+	spin_lock_init(&(lptr->device.append_lock));
+	init_waitqueue_head(&(lptr->device.inq));
 	scull_trim(&(lptr->device)); /* initialize it */
 	sema_init(&(lptr->device.sem), 1);
 
@@ -348,7 +353,12 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
+	dev->alloc = scull_alloc;
 	sema_init(&dev->sem, 1);
+	init_rwsem(&dev->append_sem);
+	INIT_LIST_HEAD(&dev->appends);
+	spin_lock_init(&dev->append_lock);
+	init_waitqueue_head(&dev->inq);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -396,12 +406,14 @@ void scull_access_cleanup(void)
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
 		cdev_del(&dev->cdev);
 		scull_trim(scull_access_devs[i].sculldev);
+		scull_alloc_release(dev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
 		scull_trim(&(lptr->device));
+		scull_alloc_release(&(lptr->device));
 		kfree(lptr);
 	}
 
@@ -0,0 +1,444 @@
+/*
+ * alloc.c -- quantum allocators for scull
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * scullc, scullp and scullv show how the same device can be built on
+ * a slab cache, on whole pages or on vmalloc. Here the bare scull gets
+ * all of them behind one table of operations, and each device can be
+ * switched at run time with SCULL_IOCTALLOC.
+ *
+ * The other modules stay as the book has them, for their mmap and
+ * driver-model examples, and get no new allocator work: that goes in
+ * the table below. scullp and sculld share their page-order quanta
+ * (NUMA placement, fallback to lower orders) through
+ * include/scullpages.h, so a fix there lands in both.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc(), kmem_cache_*() */
+#include <linux/gfp.h>		/* __get_free_pages() */
+#include <linux/mm.h>		/* alloc_page(), page_address() */
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/cdev.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>	/* for scull.h */
+
+#include "scull.h"		/* local definitions */
+
+int scull_alloc = SCULL_ALLOC_KMALLOC;	/* allocator of new devices */
+module_param(scull_alloc, int, S_IRUGO);
+
+struct scull_alloc_ops {
+	const char *name;
+	void *(*alloc)(struct scull_dev *dev);	/* a zeroed quantum */
+	void (*free)(struct scull_dev *dev, void *quantum);
+	/* address of byte q_pos, and how many bytes are contiguous there */
+	void *(*map)(struct scull_dev *dev, void *quantum, int q_pos, int *avail);
+	void (*release)(struct scull_dev *dev); /* drop per-device state */
+};
+
+/*
+ * Most quanta are contiguous in kernel space.
+ */
+static void *scull_contig_map(struct scull_dev *dev, void *quantum, int q_pos,
+		int *avail)
+{
+	*avail = dev->quantum - q_pos;
+	return quantum + q_pos;
+}
+
+
+/*
+ * kmalloc: what scull always did.
+ */
+static void *scull_kmalloc_alloc(struct scull_dev *dev)
+{
+	return kzalloc(dev->quantum, GFP_KERNEL);
+}
+
+static void scull_kmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	kfree(quantum);
+}
+
+
+/*
+ * A slab cache of its own for each device, as scullc does. The
+ * quantum can change at trim time, so the cache is (re)created on
+ * demand when it doesn't fit; it is empty by then.
+ */
+static void *scull_cache_alloc(struct scull_dev *dev)
+{
+	if (dev->cache && dev->cache_size != dev->quantum) {
+		kmem_cache_destroy(dev->cache);
+		dev->cache = NULL;
+	}
+	if (!dev->cache) {
+		snprintf(dev->cache_name, sizeof(dev->cache_name), "scull_%p", dev);
+		dev->cache = kmem_cache_create(dev->cache_name, dev->quantum,
+				0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor */
+		if (!dev->cache)
+			return NULL;
+		dev->cache_size = dev->quantum;
+	}
+	return kmem_cache_zalloc(dev->cache, GFP_KERNEL);
+}
+
+static void scull_cache_free(struct scull_dev *dev, void *quantum)
+{
+	kmem_cache_free(dev->cache, quantum);
+}
+
+static void scull_cache_release(struct scull_dev *dev)
+{
+	if (dev->cache)
+		kmem_cache_destroy(dev->cache);
+	dev->cache = NULL;
+}
+
+
+/*
+ * Whole pages, as scullp does: the quantum is rounded up to a power
+ * of two pages.
+ */
+static void *scull_pages_alloc(struct scull_dev *dev)
+{
+	return (void *) __get_free_pages(GFP_KERNEL | __GFP_COMP | __GFP_ZERO,
+			get_order(dev->quantum));
+}
+
+static void scull_pages_free(struct scull_dev *dev, void *quantum)
+{
+	free_pages((unsigned long) quantum, get_order(dev->quantum));
+}
+
+
+/*
+ * vmalloc, as scullv used to do.
+ */
+static void *scull_vmalloc_alloc(struct scull_dev *dev)
+{
+	void *quantum = vmalloc(dev->quantum);
+
+	if (quantum)
+		memset(quantum, 0, dev->quantum);
+	return quantum;
+}
+
+static void scull_vmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	vfree(quantum);
+}
+
+
+/*
+ * An array of single pages, as scullv does now: no high-order
+ * allocation and no vmap area, but the quantum is only contiguous
+ * up to the end of each page.
+ */
+static void *scull_pagearray_alloc(struct scull_dev *dev)
+{
+	int i, n = DIV_ROUND_UP(dev->quantum, PAGE_SIZE);
+	struct page **pages;
+
+	pages = kzalloc(n * sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!pages[i]) {
+			while (i--)
+				__free_page(pages[i]);
+			kfree(pages);
+			return NULL;
+		}
+	}
+	return pages;
+}
+
+static void scull_pagearray_free(struct scull_dev *dev, void *quantum)
+{
+	int i, n = DIV_ROUND_UP(dev->quantum, PAGE_SIZE);
+	struct page **pages = quantum;
+
+	for (i = 0; i < n; i++)
+		__free_page(pages[i]);
+	kfree(pages);
+}
+
+static void *scull_pagearray_map(struct scull_dev *dev, void *quantum, int q_pos,
+		int *avail)
+{
+	struct page **pages = quantum;
+	int offset = q_pos & ~PAGE_MASK;
+
+	*avail = min_t(int, PAGE_SIZE - offset, dev->quantum - q_pos);
+	return page_address(pages[q_pos >> PAGE_SHIFT]) + offset;
+}
+
+
+static struct scull_alloc_ops scull_allocators[SCULL_ALLOC_NR] = {
+	[SCULL_ALLOC_KMALLOC] = {
+		.name =    "kmalloc",
+		.alloc =   scull_kmalloc_alloc,
+		.free =    scull_kmalloc_free,
+		.map =     scull_contig_map,
+	},
+	[SCULL_ALLOC_CACHE] = {
+		.name =    "cache",
+		.alloc =   scull_cache_alloc,
+		.free =    scull_cache_free,
+		.map =     scull_contig_map,
+		.release = scull_cache_release,
+	},
+	[SCULL_ALLOC_PAGES] = {
+		.name =    "pages",
+		.alloc =   scull_pages_alloc,
+		.free =    scull_pages_free,
+		.map =     scull_contig_map,
+	},
+	[SCULL_ALLOC_VMALLOC] = {
+		.name =    "vmalloc",
+		.alloc =   scull_vmalloc_alloc,
+		.free =    scull_vmalloc_free,
+		.map =     scull_contig_map,
+	},
+	[SCULL_ALLOC_PAGEARRAY] = {
+		.name =    "pagearray",
+		.alloc =   scull_pagearray_alloc,
+		.free =    scull_pagearray_free,
+		.map =     scull_pagearray_map,
+	},
+};
+
+
+/*
+ * List items: the header and the array of quanta come together, from
+ * a slab cache for that qset size. The caches are shared by all the
+ * devices with the same qset, and live as long as somebody uses them.
+ */
+struct scull_qset_cache {
+	struct list_head list;
+	struct kmem_cache *cache;
+	int qset;
+	int users;
+	char name[24];
+};
+
+static LIST_HEAD(scull_qset_caches);
+static DEFINE_MUTEX(scull_qset_mutex);	/* protects the list above */
+
+static struct scull_qset_cache *scull_get_qset_cache(int qset)
+{
+	struct scull_qset_cache *qc;
+
+	mutex_lock(&scull_qset_mutex);
+	list_for_each_entry(qc, &scull_qset_caches, list)
+		if (qc->qset == qset)
+			goto found;
+	qc = kzalloc(sizeof(struct scull_qset_cache), GFP_KERNEL);
+	if (!qc)
+		goto out;
+	snprintf(qc->name, sizeof(qc->name), "scull_qset%i", qset);
+	qc->cache = kmem_cache_create(qc->name, sizeof(struct scull_qset) +
+			qset * sizeof(struct scull_quantum *), 0, 0, NULL);
+	if (!qc->cache) {
+		kfree(qc);
+		qc = NULL;
+		goto out;
+	}
+	qc->qset = qset;
+	list_add(&qc->list, &scull_qset_caches);
+  found:
+	qc->users++;
+  out:
+	mutex_unlock(&scull_qset_mutex);
+	return qc;
+}
+
+static void scull_put_qset_cache(struct scull_qset_cache *qc)
+{
+	mutex_lock(&scull_qset_mutex);
+	if (--qc->users == 0) {
+		list_del(&qc->list);
+		kmem_cache_destroy(qc->cache);
+		kfree(qc);
+	}
+	mutex_unlock(&scull_qset_mutex);
+}
+
+/*
+ * The qset of a device only changes while it's empty, and so does
+ * the cache it uses.
+ */
+struct scull_qset *scull_alloc_qset(struct scull_dev *dev)
+{
+	if (dev->qcache && dev->qcache->qset != dev->qset) {
+		scull_put_qset_cache(dev->qcache);
+		dev->qcache = NULL;
+	}
+	if (!dev->qcache) {
+		dev->qcache = scull_get_qset_cache(dev->qset);
+		if (!dev->qcache)
+			return NULL;
+	}
+	return kmem_cache_zalloc(dev->qcache->cache, GFP_KERNEL);
+}
+
+void scull_free_qset(struct scull_dev *dev, struct scull_qset *qs)
+{
+	kmem_cache_free(dev->qcache->cache, qs);
+}
+
+/*
+ * Quanta holding only zeros are all replaced by this one, which has
+ * no memory at all and is never freed (see scull_write()).
+ */
+struct scull_quantum scull_zero_quantum = {
+	.count = ATOMIC_INIT(1),
+};
+
+/*
+ * Bare allocator memory, for compress.c which keeps the header of a
+ * quantum while its contents come and go.
+ */
+void *scull_alloc_mem(struct scull_dev *dev)
+{
+	return scull_allocators[dev->alloc].alloc(dev);
+}
+
+void scull_free_mem(struct scull_dev *dev, void *mem)
+{
+	scull_allocators[dev->alloc].free(dev, mem);
+}
+
+void *scull_mem_ptr(struct scull_dev *dev, void *mem, int q_pos, int *avail)
+{
+	return scull_allocators[dev->alloc].map(dev, mem, q_pos, avail);
+}
+
+/*
+ * The interface used by the rest of scull. A quantum is a small
+ * header, with a reference count, around the allocator memory.
+ */
+struct scull_quantum *scull_alloc_quantum(struct scull_dev *dev)
+{
+	struct scull_quantum *quantum;
+
+	quantum = kmalloc(sizeof(struct scull_quantum), GFP_KERNEL);
+	if (!quantum)
+		return NULL;
+	quantum->mem = scull_alloc_mem(dev);
+	if (!quantum->mem) {
+		kfree(quantum);
+		return NULL;
+	}
+	atomic_set(&quantum->count, 1);
+	quantum->atime = jiffies;
+	quantum->zdata = NULL;
+	quantum->zlen = 0;
+	quantum->prealloc = 0;
+	return quantum;
+}
+
+void scull_put_quantum(struct scull_dev *dev, struct scull_quantum *quantum)
+{
+	if (quantum == &scull_zero_quantum)
+		return;
+	if (!atomic_dec_and_test(&quantum->count))
+		return; /* a clone still uses it */
+	if (quantum->mem)
+		scull_free_mem(dev, quantum->mem);
+	kfree(quantum->zdata); /* if it was compressed */
+	kfree(quantum);
+}
+
+/*
+ * The quantum must be resident: see scull_touch_quantum().
+ */
+void *scull_quantum_ptr(struct scull_dev *dev, struct scull_quantum *quantum,
+		int q_pos, int *avail)
+{
+	return scull_mem_ptr(dev, quantum->mem, q_pos, avail);
+}
+
+/*
+ * Get a quantum the device can write to: if it is shared with a clone,
+ * copy it and drop our reference to the original. Returns NULL if out
+ * of memory, in which case the original is left alone. The original
+ * must be resident.
+ */
+struct scull_quantum *scull_unshare_quantum(struct scull_dev *dev,
+		struct scull_quantum *quantum)
+{
+	struct scull_quantum *copy;
+	int pos, avail;
+	void *src;
+
+	if (atomic_read(&quantum->count) == 1)
+		return quantum;
+	copy = scull_alloc_quantum(dev);
+	if (!copy)
+		return NULL;
+	copy->prealloc = quantum->prealloc;
+	for (pos = 0; pos < dev->quantum; pos += avail) {
+		src = scull_quantum_ptr(dev, quantum, pos, &avail);
+		memcpy(scull_quantum_ptr(dev, copy, pos, &avail), src, avail);
+	}
+	scull_put_quantum(dev, quantum);
+	return copy;
+}
+
+const char *scull_alloc_name(struct scull_dev *dev)
+{
+	return scull_allocators[dev->alloc].name;
+}
+
+/*
+ * Drop whatever the allocator keeps for this device. The device
+ * must be empty: called at cleanup time and when switching.
+ */
+void scull_alloc_release(struct scull_dev *dev)
+{
+	if (scull_allocators[dev->alloc].release)
+		scull_allocators[dev->alloc].release(dev);
+	if (dev->qcache)
+		scull_put_qset_cache(dev->qcache);
+	dev->qcache = NULL;
+}
+
+/*
+ * Switch allocator; must be called with the device semaphore held.
+ * Quanta can't be moved from one allocator to another, so the device
+ * must be empty (open it write-only to trim it first).
+ */
+int scull_set_alloc(struct scull_dev *dev, int alloc)
+{
+	if (alloc < 0 || alloc >= SCULL_ALLOC_NR)
+		return -EINVAL;
+	if (dev->data)
+		return -EBUSY;
+	scull_alloc_release(dev);
+	dev->alloc = alloc;
+	return 0;
+}
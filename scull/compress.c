@@ -0,0 +1,249 @@
+/*
+ * compress.c -- compression of cold scull quanta
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * Data written to scull is often read rarely, if ever. A worker looks
+ * at the bare devices once a second, and replaces the quanta not
+ * accessed for dev->cold seconds with their LZO-compressed contents;
+ * read and write decompress them again on the way in.
+ *
+ * Only quanta used by a single device are compressed, and the worker
+ * holds the semaphore of that device, so nobody else can be looking.
+ * A compressed quantum can be shared later by SCULL_IOCCLONE, though,
+ * and then two devices may want it back at the same time: that's what
+ * scull_zmutex is for.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/cdev.h>
+#include <linux/sched.h>	/* cond_resched() */
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
+
+#include "scull.h"		/* local definitions */
+
+int scull_cold = 0;	/* default dev->cold, in seconds; 0: never */
+module_param(scull_cold, int, S_IRUGO);
+
+static DEFINE_MUTEX(scull_zmutex);
+
+static void scull_cold_scan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_cold_work, scull_cold_scan);
+
+/*
+ * Buffers of the worker: LZO state, a place to gather quanta that are
+ * not contiguous, and the compressor output. Only the worker uses them.
+ */
+static void *scull_wrkmem;
+static void *scull_rawbuf, *scull_zbuf;
+static int scull_zbuf_size;
+
+static int scull_zbuf_grow(int quantum)
+{
+	if (quantum <= scull_zbuf_size)
+		return 0;
+	vfree(scull_rawbuf);
+	vfree(scull_zbuf);
+	scull_zbuf_size = 0;
+	scull_rawbuf = vmalloc(quantum);
+	scull_zbuf = vmalloc(lzo1x_worst_compress(quantum));
+	if (!scull_rawbuf || !scull_zbuf)
+		return -ENOMEM;
+	scull_zbuf_size = quantum;
+	return 0;
+}
+
+/*
+ * Compress one quantum; the device semaphore is held and nobody
+ * else uses the quantum.
+ */
+static void scull_compress(struct scull_dev *dev, struct scull_quantum *q)
+{
+	size_t zlen;
+	void *src, *zdata;
+	int pos, avail;
+
+	src = scull_mem_ptr(dev, q->mem, 0, &avail);
+	if (avail < dev->quantum) { /* gather the pieces */
+		for (pos = 0; pos < dev->quantum; pos += avail)
+			memcpy(scull_rawbuf + pos,
+					scull_mem_ptr(dev, q->mem, pos, &avail), avail);
+		src = scull_rawbuf;
+	}
+	if (lzo1x_1_compress(src, dev->quantum, scull_zbuf, &zlen,
+				scull_wrkmem) != LZO_E_OK)
+		goto keep;
+	if (zlen > dev->quantum - dev->quantum / 8)
+		goto keep; /* not worth it */
+	zdata = kmalloc(zlen, GFP_KERNEL);
+	if (!zdata)
+		goto keep;
+	memcpy(zdata, scull_zbuf, zlen);
+	scull_free_mem(dev, q->mem);
+	q->mem = NULL;
+	q->zdata = zdata;
+	q->zlen = zlen;
+	dev->zstats.compressions++;
+	dev->zstats.bytes_in += dev->quantum;
+	dev->zstats.bytes_out += zlen;
+	return;
+
+  keep:
+	q->atime = jiffies; /* try again after another interval */
+}
+
+static void scull_cold_scan_dev(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+	struct scull_quantum *q;
+	int j;
+
+	if (dev->cold <= 0 || !dev->data)
+		return;
+	if (down_trylock(&dev->sem))
+		return; /* busy, so probably not cold */
+	if (!down_write_trylock(&dev->append_sem)) {
+		up(&dev->sem); /* appends in flight */
+		return;
+	}
+	if (scull_zbuf_grow(dev->quantum) == 0)
+		for (dptr = dev->data; dptr; dptr = dptr->next) {
+			for (j = 0; j < dev->qset; j++) {
+				q = dptr->data[j];
+				if (q && q->mem && atomic_read(&q->count) == 1
+						&& time_after(jiffies,
+						q->atime + dev->cold * HZ))
+					scull_compress(dev, q);
+			}
+			cond_resched();
+		}
+	up_write(&dev->append_sem);
+	up(&dev->sem);
+}
+
+static void scull_cold_scan(struct work_struct *work)
+{
+	scull_for_each_dev(scull_cold_scan_dev);
+	schedule_delayed_work(&scull_cold_work, HZ);
+}
+
+/*
+ * Bring a compressed quantum back; the device semaphore is held.
+ */
+static int scull_decompress(struct scull_dev *dev, struct scull_quantum *q)
+{
+	void *mem, *dst, *buf = NULL;
+	size_t len = dev->quantum;
+	int pos, avail, retval = 0;
+	ktime_t start;
+	s64 ns;
+
+	mutex_lock(&scull_zmutex);
+	if (q->mem)
+		goto out; /* a clone got here first */
+	start = ktime_get();
+	retval = -ENOMEM;
+	mem = scull_alloc_mem(dev);
+	if (!mem)
+		goto out;
+	dst = scull_mem_ptr(dev, mem, 0, &avail);
+	if (avail < dev->quantum) {
+		dst = buf = vmalloc(dev->quantum);
+		if (!buf)
+			goto fail;
+	}
+	if (lzo1x_decompress_safe(q->zdata, q->zlen, dst, &len) != LZO_E_OK
+			|| len != dev->quantum) {
+		retval = -EIO;
+		goto fail;
+	}
+	if (buf) {
+		for (pos = 0; pos < dev->quantum; pos += avail)
+			memcpy(scull_mem_ptr(dev, mem, pos, &avail), buf + pos, avail);
+		vfree(buf);
+	}
+	kfree(q->zdata);
+	q->zdata = NULL;
+	smp_wmb(); /* clones look at q->mem without the mutex */
+	q->mem = mem;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	dev->zstats.decompressions++;
+	dev->zstats.decomp_ns += ns;
+	if (ns > dev->zstats.decomp_max_ns)
+		dev->zstats.decomp_max_ns = ns;
+	retval = 0;
+	goto out;
+
+  fail:
+	vfree(buf);
+	scull_free_mem(dev, mem);
+  out:
+	mutex_unlock(&scull_zmutex);
+	return retval;
+}
+
+/*
+ * Called by read and write before using a quantum, with the device
+ * semaphore held: make sure it is resident, and that it stays so
+ * for a while.
+ */
+int scull_touch_quantum(struct scull_dev *dev, struct scull_quantum *quantum)
+{
+	if (quantum == &scull_zero_quantum)
+		return 0; /* nothing to bring back */
+	quantum->atime = jiffies;
+	if (likely(quantum->mem))
+		return 0;
+	return scull_decompress(dev, quantum);
+}
+
+int scull_cold_init(void)
+{
+	if (scull_cold < 0) {
+		printk(KERN_NOTICE "scull: bad cold delay %d, not compressing\n",
+				scull_cold);
+		scull_cold = 0;
+	}
+	scull_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!scull_wrkmem)
+		return -ENOMEM;
+	schedule_delayed_work(&scull_cold_work, HZ);
+	return 0;
+}
+
+/*
+ * Must run before the devices go away; harmless if init never ran.
+ */
+void scull_cold_cleanup(void)
+{
+	cancel_delayed_work_sync(&scull_cold_work);
+	vfree(scull_wrkmem);
+	vfree(scull_rawbuf);
+	vfree(scull_zbuf);
+	scull_wrkmem = scull_rawbuf = scull_zbuf = NULL;
+	scull_zbuf_size = 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * latency.c -- tracepoints and latency histograms for scull
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * PDEBUG needs a rebuild; this doesn't. Every read and write of the
+ * bare and pipe devices goes through scull_lat_start() and
+ * scull_lat_done(), which fire the tracepoints in trace.h and count
+ * the time spent (in all, and waiting for the device semaphore) in
+ * log2 histograms. These are in debugfs, under scull/; writing to a
+ * file clears it.
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/cdev.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>	/* fls64() */
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+
+#include "scull.h"		/* local definitions */
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+#define SCULL_LAT_BUCKETS 40	/* up to 2^39 ns, some nine minutes */
+
+struct scull_hist {
+	atomic_long_t count[SCULL_LAT_BUCKETS];
+};
+
+static struct scull_hist scull_lat_total[SCULL_LAT_NR];
+static struct scull_hist scull_lat_wait[SCULL_LAT_NR];
+
+static const char *scull_lat_names[SCULL_LAT_NR] = {
+	[SCULL_LAT_READ]    = "read",
+	[SCULL_LAT_WRITE]   = "write",
+	[SCULL_LAT_P_READ]  = "pipe_read",
+	[SCULL_LAT_P_WRITE] = "pipe_write",
+};
+
+static struct dentry *scull_debug_dir;
+
+static void scull_hist_add(struct scull_hist *hist, s64 ns)
+{
+	int bucket = ns > 0 ? fls64(ns) : 0;
+
+	if (bucket >= SCULL_LAT_BUCKETS)
+		bucket = SCULL_LAT_BUCKETS - 1;
+	atomic_long_inc(&hist->count[bucket]);
+}
+
+ktime_t scull_lat_start(int op, int minor, loff_t pos, size_t count)
+{
+	trace_scull_io_start(op, minor, pos, count);
+	return ktime_get();
+}
+
+/*
+ * "locked" is when the semaphore was first taken.
+ */
+void scull_lat_done(int op, int minor, loff_t pos, ssize_t ret,
+		ktime_t start, ktime_t locked)
+{
+	s64 wait = ktime_to_ns(ktime_sub(locked, start));
+	s64 total = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	scull_hist_add(scull_lat_wait + op, wait);
+	scull_hist_add(scull_lat_total + op, total);
+	trace_scull_io_done(op, minor, pos, ret, wait, total);
+}
+
+
+/*
+ * The debugfs files: one line per bucket that is not empty.
+ */
+static int scull_hist_show(struct seq_file *s, void *v)
+{
+	struct scull_hist *hist = s->private;
+	unsigned long n;
+	int i;
+
+	seq_printf(s, "%12s %12s %10s\n", "from(ns)", "to(ns)", "count");
+	for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+		n = atomic_long_read(&hist->count[i]);
+		if (n)
+			seq_printf(s, "%12llu %12llu %10lu\n",
+					i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, n);
+	}
+	return 0;
+}
+
+static int scull_hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, scull_hist_show, inode->i_private);
+}
+
+static ssize_t scull_hist_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct scull_hist *hist = ((struct seq_file *)filp->private_data)->private;
+	int i;
+
+	for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+		atomic_long_set(&hist->count[i], 0);
+	return count;
+}
+
+static struct file_operations scull_hist_fops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_hist_open,
+	.read    = seq_read,
+	.write   = scull_hist_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Without debugfs, the tracepoints and histograms still work; there's
+ * just no way to read the latter.
+ */
+void scull_lat_init(void)
+{
+	char name[32];
+	int i;
+
+	scull_debug_dir = debugfs_create_dir("scull", NULL);
+	if (IS_ERR_OR_NULL(scull_debug_dir)) {
+		scull_debug_dir = NULL;
+		return;
+	}
+	for (i = 0; i < SCULL_LAT_NR; i++) {
+		debugfs_create_file(scull_lat_names[i], S_IRUSR | S_IWUSR,
+				scull_debug_dir, scull_lat_total + i,
+				&scull_hist_fops);
+		snprintf(name, sizeof(name), "%s_lock_wait", scull_lat_names[i]);
+		debugfs_create_file(name, S_IRUSR | S_IWUSR, scull_debug_dir,
+				scull_lat_wait + i, &scull_hist_fops);
+	}
+}
+
+void scull_lat_cleanup(void)
+{
+	debugfs_remove_recursive(scull_debug_dir); /* NULL is fine */
+	scull_debug_dir = NULL;
+}
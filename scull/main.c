@@ -23,10 +23,22 @@
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
+#include <linux/math64.h>	/* div64_u64() */
+#include <linux/string.h>	/* memchr_inv() */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
+#include <linux/file.h>		/* fget(), fput() */
+#include <linux/falloc.h>	/* FALLOC_FL_* */
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
 #include <linux/cdev.h>
+#include <linux/radix-tree.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
 
 #include <asm/system.h>		/* cli(), *_flags */
 #include <asm/uaccess.h>	/* copy_*_user */
@@ -42,19 +54,49 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+unsigned long scull_ring = 0;		/* ring size of new devices; 0: none */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_ring, ulong, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct scull_dev *scull_devices;	/* allocated in scull_init_module */
+/*
+ * The bare devices are only created when opened, and freed at last
+ * close if they hold nothing, so that scull_nr_devs can be large.
+ * They are kept in a radix tree, indexed by minor less scull_minor;
+ * a single cdev covers them all.
+ */
+static RADIX_TREE(scull_devtree, GFP_KERNEL);
+static DEFINE_MUTEX(scull_devtree_mutex);	/* tree and dev->users */
+static struct cdev scull_cdev;
 
 
+/*
+ * The end of the data readers can see. It trails dev->size while
+ * O_APPEND writers copy their records in, see scull_append(); with no
+ * appends in flight the two are the same, so whoever changes the size
+ * in any other way commits it at once.
+ */
+static inline loff_t scull_committed(struct scull_dev *dev)
+{
+	loff_t end = atomic64_read(&dev->committed);
+
+	smp_rmb(); /* the data is there, see below */
+	return end;
+}
+
+static inline void scull_commit(struct scull_dev *dev, loff_t end)
+{
+	smp_wmb(); /* the data before the size that shows it */
+	atomic64_set(&dev->committed, end);
+}
+
 /*
  * Empty out the scull device; must be called with the device
  * semaphore held.
@@ -65,22 +107,126 @@ int scull_trim(struct scull_dev *dev)
 	int qset = dev->qset;   /* "dev" is not-null */
 	int i;
 
+	down_write(&dev->append_sem); /* wait for appends in flight */
 	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
+		for (i = 0; i < qset; i++)
+			if (dptr->data[i])
+				scull_put_quantum(dev, dptr->data[i]);
 		next = dptr->next;
-		kfree(dptr);
+		scull_free_qset(dev, dptr);
 	}
 	dev->size = 0;
+	scull_commit(dev, 0);
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
 	dev->data = NULL;
+	dev->ring = roundup(dev->ring, dev->quantum); /* whole quanta */
+	up_write(&dev->append_sem);
 	return 0;
 }
+
+/*
+ * Follow mode belongs to the open file, like O_NONBLOCK, and lives
+ * next to it in f_flags: in the O_NOCTTY bit, which open() clears and
+ * fcntl() leaves alone. It is changed under f_lock, as fcntl() does.
+ */
+#define SCULL_F_FOLLOW O_NOCTTY
+
+static inline int scull_following(struct file *filp)
+{
+	return (filp->f_flags & SCULL_F_FOLLOW) != 0;
+}
+
+/*
+ * Lookup of a bare device, creating it if need be; the caller gets
+ * a reference, to be dropped with scull_put_dev().
+ */
+static struct scull_dev *scull_get_dev(int index)
+{
+	struct scull_dev *dev;
+
+	mutex_lock(&scull_devtree_mutex);
+	dev = radix_tree_lookup(&scull_devtree, index);
+	if (dev)
+		goto found;
+	dev = kzalloc(sizeof(struct scull_dev), GFP_KERNEL);
+	if (!dev)
+		goto out;
+	dev->index = index;
+	dev->quantum = scull_quantum;
+	dev->qset = scull_qset;
+	dev->alloc = scull_alloc;
+	dev->cold = scull_cold;
+	dev->ring = roundup(scull_ring, scull_quantum);
+	sema_init(&dev->sem, 1);
+	init_rwsem(&dev->append_sem);
+	INIT_LIST_HEAD(&dev->appends);
+	spin_lock_init(&dev->append_lock);
+	init_waitqueue_head(&dev->inq);
+	if (radix_tree_insert(&scull_devtree, index, dev)) {
+		kfree(dev);
+		dev = NULL;
+		goto out;
+	}
+  found:
+	dev->users++;
+  out:
+	mutex_unlock(&scull_devtree_mutex);
+	return dev;
+}
+
+/*
+ * A device can go when it holds no data and no settings but the
+ * defaults, as it would be created again just the same.
+ */
+static int scull_dev_idle(struct scull_dev *dev)
+{
+	return !dev->data && dev->alloc == scull_alloc &&
+		dev->cold == scull_cold &&
+		dev->ring == roundup(scull_ring, dev->quantum);
+}
+
+static void scull_free_dev(struct scull_dev *dev)
+{
+	radix_tree_delete(&scull_devtree, dev->index);
+	scull_trim(dev);
+	scull_alloc_release(dev);
+	kfree(dev);
+}
+
+static void scull_put_dev(struct scull_dev *dev)
+{
+	mutex_lock(&scull_devtree_mutex);
+	/* with no users left, nobody else can be looking at it */
+	if (--dev->users == 0 && scull_dev_idle(dev))
+		scull_free_dev(dev);
+	mutex_unlock(&scull_devtree_mutex);
+}
+
+/*
+ * Call fn() for each existing bare device, holding a reference to it
+ * but no lock.
+ */
+void scull_for_each_dev(void (*fn)(struct scull_dev *dev))
+{
+	struct scull_dev *dev;
+	unsigned long index = 0;
+
+	for (;;) {
+		mutex_lock(&scull_devtree_mutex);
+		if (!radix_tree_gang_lookup(&scull_devtree, (void **)&dev,
+					index, 1)) {
+			mutex_unlock(&scull_devtree_mutex);
+			return;
+		}
+		dev->users++;
+		mutex_unlock(&scull_devtree_mutex);
+		fn(dev);
+		index = dev->index + 1;
+		scull_put_dev(dev);
+	}
+}
+
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The proc filesystem: function to read and entry
@@ -89,20 +235,32 @@ int scull_trim(struct scull_dev *dev)
 int scull_read_procmem(char *buf, char **start, off_t offset,
                    int count, int *eof, void *data)
 {
-	int i, j, len = 0;
+	int j, len = 0;
 	int limit = count - 80; /* Don't print more than this */
+	unsigned long index = 0;
+	struct scull_dev *d;
 
-	for (i = 0; i < scull_nr_devs && len <= limit; i++) {
-		struct scull_dev *d = &scull_devices[i];
+	mutex_lock(&scull_devtree_mutex);
+	while (len <= limit && radix_tree_gang_lookup(&scull_devtree,
+				(void **)&d, index, 1)) {
 		struct scull_qset *qs = d->data;
-		if (down_interruptible(&d->sem))
+		index = d->index + 1;
+		if (down_interruptible(&d->sem)) {
+			mutex_unlock(&scull_devtree_mutex);
 			return -ERESTARTSYS;
-		len += sprintf(buf+len,"\nDevice %i: qset %i, q %i, sz %li\n",
-				i, d->qset, d->quantum, d->size);
+		}
+		len += sprintf(buf+len,"\nDevice %i: qset %i, q %i, sz %lli, %s\n",
+				d->index, d->qset, d->quantum, (long long) d->size,
+				scull_alloc_name(d));
+		if (d->zstats.compressions)
+			len += sprintf(buf + len, "  compressed %lu: %lu -> %lu bytes,"
+					" %lu back\n", d->zstats.compressions,
+					d->zstats.bytes_in, d->zstats.bytes_out,
+					d->zstats.decompressions);
 		for (; qs && len <= limit; qs = qs->next) { /* scan the list */
 			len += sprintf(buf + len, "  item at %p, qset at %p\n",
 					qs, qs->data);
-			if (qs->data && !qs->next) /* dump only the last item */
+			if (!qs->next) /* dump only the last item */
 				for (j = 0; j < d->qset; j++) {
 					if (qs->data[j])
 						len += sprintf(buf + len,
@@ -110,8 +268,9 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 								j, qs->data[j]);
 				}
 		}
-		up(&scull_devices[i].sem);
+		up(&d->sem);
 	}
+	mutex_unlock(&scull_devtree_mutex);
 	*eof = 1;
 	return len;
 }
@@ -124,26 +283,35 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 
 /*
  * Here are our sequence iteration methods.  Our "position" is
- * simply the device number.
+ * simply the device number, skipping the ones that don't exist.
+ * The tree is locked from start to stop.
  */
-static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+static void *scull_seq_find(loff_t *pos)
 {
-	if (*pos >= scull_nr_devs)
+	struct scull_dev *dev;
+
+	if (*pos >= scull_nr_devs || !radix_tree_gang_lookup(&scull_devtree,
+				(void **)&dev, *pos, 1))
 		return NULL;   /* No more to read */
-	return scull_devices + *pos;
+	*pos = dev->index;
+	return dev;
+}
+
+static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+{
+	mutex_lock(&scull_devtree_mutex);
+	return scull_seq_find(pos);
 }
 
 static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
 	(*pos)++;
-	if (*pos >= scull_nr_devs)
-		return NULL;
-	return scull_devices + *pos;
+	return scull_seq_find(pos);
 }
 
 static void scull_seq_stop(struct seq_file *s, void *v)
 {
-	/* Actually, there's nothing to do here */
+	mutex_unlock(&scull_devtree_mutex);
 }
 
 static int scull_seq_show(struct seq_file *s, void *v)
@@ -154,12 +322,18 @@ static int scull_seq_show(struct seq_file *s, void *v)
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
-	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-			(int) (dev - scull_devices), dev->qset,
-			dev->quantum, dev->size);
+	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %lli, %s\n",
+			dev->index, dev->qset,
+			dev->quantum, (long long) dev->size, scull_alloc_name(dev));
+	if (dev->zstats.compressions)
+		seq_printf(s, "  compressed %lu: %lu -> %lu bytes, %lu back"
+				" (%llu ns, max %llu)\n", dev->zstats.compressions,
+				dev->zstats.bytes_in, dev->zstats.bytes_out,
+				dev->zstats.decompressions, dev->zstats.decomp_ns,
+				dev->zstats.decomp_max_ns);
 	for (d = dev->data; d; d = d->next) { /* scan the list */
 		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
+		if (!d->next) /* dump only the last item */
 			for (i = 0; i < dev->qset; i++) {
 				if (d->data[i])
 					seq_printf(s, "    % 4i: %8p\n",
@@ -238,13 +412,21 @@ int scull_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev; /* device information */
 
-	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	dev = scull_get_dev(iminor(inode) - scull_minor);
+	if (!dev)
+		return -ENOMEM;
 	filp->private_data = dev; /* for other methods */
 
-	/* now trim to 0 the length of the device if open was write-only */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+	/*
+	 * now trim to 0 the length of the device if open was write-only,
+	 * unless it was opened to append to it
+	 */
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY &&
+			!(filp->f_flags & O_APPEND)) {
+		if (down_interruptible(&dev->sem)) {
+			scull_put_dev(dev);
 			return -ERESTARTSYS;
+		}
 		scull_trim(dev); /* ignore errors */
 		up(&dev->sem);
 	}
@@ -253,30 +435,29 @@ int scull_open(struct inode *inode, struct file *filp)
 
 int scull_release(struct inode *inode, struct file *filp)
 {
+	scull_put_dev(filp->private_data);
 	return 0;
 }
 /*
  * Follow the list
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+struct scull_qset *scull_follow(struct scull_dev *dev, long n)
 {
 	struct scull_qset *qs = dev->data;
 
         /* Allocate first qset explicitly if need be */
 	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+		qs = dev->data = scull_alloc_qset(dev);
 		if (qs == NULL)
 			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
 	}
 
 	/* Then follow the list */
 	while (n--) {
 		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+			qs->next = scull_alloc_qset(dev);
 			if (qs->next == NULL)
 				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
 		}
 		qs = qs->next;
 		continue;
@@ -284,6 +465,45 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 	return qs;
 }
 
+/*
+ * In ring mode (dev->ring != 0) the device only keeps the last
+ * dev->ring bytes written. Offsets keep growing as usual, but they
+ * wrap around in the quanta, so once the ring is full new data goes
+ * in place of the oldest and nothing is allocated anymore. The ring
+ * is a whole number of quanta, so a quantum never wraps.
+ */
+static inline loff_t scull_ring_pos(struct scull_dev *dev, loff_t pos)
+{
+	if (!dev->ring)
+		return pos;
+	return pos - div64_u64(pos, dev->ring) * dev->ring;
+}
+
+/* The first offset still there */
+static inline loff_t scull_ring_start(struct scull_dev *dev)
+{
+	return dev->ring && dev->size > dev->ring ? dev->size - dev->ring : 0;
+}
+
+/*
+ * Find where byte "pos" lives: list item, quantum in the item and
+ * offset in the quantum. A list item holds quantum * qset bytes, which
+ * doesn't fit an int with quanta of a few megabytes, and positions go
+ * well beyond 4GB: the arithmetic is 64-bit, with the helpers that
+ * 32-bit processors need for it.
+ */
+static void scull_locate(struct scull_dev *dev, loff_t pos, long *item,
+		int *s_pos, int *q_pos)
+{
+	u64 itemsize = (u64)dev->quantum * dev->qset;
+	u64 n = div64_u64(pos, itemsize);
+	u32 rem;
+
+	*item = n;
+	*s_pos = div_u64_rem(pos - n * itemsize, dev->quantum, &rem);
+	*q_pos = rem;
+}
+
 /*
  * Data management: read and write
  */
@@ -293,98 +513,525 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 {
 	struct scull_dev *dev = filp->private_data; 
 	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
-
+	int quantum = dev->quantum;
+	int minor = iminor(filp->f_path.dentry->d_inode);
+	int s_pos, q_pos, avail;
+	long item;
+	ktime_t start, locked;
+	void *ptr;
+	ssize_t retval = -ERESTARTSYS;
+
+	/* every start event gets its done event, whatever happens */
+	start = locked = scull_lat_start(SCULL_LAT_READ, minor, *f_pos, count);
 	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+		goto done;
+	locked = ktime_get();
+	retval = 0;
+	while (*f_pos >= scull_committed(dev)) { /* at the end */
+		if (!scull_following(filp))
+			goto out;
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK) {
+			retval = -EAGAIN;
+			goto done;
+		}
+		if (wait_event_interruptible(dev->inq,
+				*f_pos < scull_committed(dev) ||
+				!scull_following(filp))) {
+			retval = -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+			goto done;
+		}
+		if (down_interruptible(&dev->sem)) {
+			retval = -ERESTARTSYS;
+			goto done;
+		}
+	}
+	if (*f_pos < scull_ring_start(dev))
+		*f_pos = scull_ring_start(dev); /* overwritten: skip ahead */
+	if (*f_pos + count > scull_committed(dev))
+		count = scull_committed(dev) - *f_pos;
 
 	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	scull_locate(dev, scull_ring_pos(dev, *f_pos), &item, &s_pos, &q_pos);
 
 	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scull_follow(dev, item);
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
+	if (dptr == NULL || ! dptr->data[s_pos])
 		goto out; /* don't fill holes */
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	if (dptr->data[s_pos] == &scull_zero_quantum) {
+		/* all zeros: nothing to copy from */
+		if (count > quantum - q_pos)
+			count = quantum - q_pos;
+		if (clear_user(buf, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+	} else {
+		retval = scull_touch_quantum(dev, dptr->data[s_pos]);
+		if (retval)
+			goto out;
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+		/* read only up to the end of this quantum (or of its page) */
+		ptr = scull_quantum_ptr(dev, dptr->data[s_pos], q_pos, &avail);
+		if (count > avail)
+			count = avail;
+
+		if (copy_to_user(buf, ptr, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
 	}
 	*f_pos += count;
 	retval = count;
 
   out:
 	up(&dev->sem);
+  done:
+	scull_lat_done(SCULL_LAT_READ, minor, *f_pos, retval, start, locked);
+	return retval;
+}
+
+/*
+ * Make sure quantum s_pos of the list item is there, resident and
+ * ours alone, ready to be written to.
+ */
+static int scull_prepare_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+		int s_pos)
+{
+	struct scull_quantum *quantum;
+	int retval;
+
+	quantum = dptr->data[s_pos];
+	if (!quantum || quantum == &scull_zero_quantum) {
+		/* a hole, or the shared zeros: get a real quantum */
+		quantum = scull_alloc_quantum(dev);
+		if (!quantum)
+			return -ENOMEM;
+	} else {
+		retval = scull_touch_quantum(dev, quantum);
+		if (retval)
+			return retval;
+		/* copy-on-write, if shared with a clone */
+		quantum = scull_unshare_quantum(dev, quantum);
+		if (!quantum)
+			return -ENOMEM;
+	}
+	dptr->data[s_pos] = quantum;
+	return 0;
+}
+
+/*
+ * O_APPEND writers only serialize on the bookkeeping: each one reserves
+ * its range at the end of the device and gets the quanta ready with the
+ * semaphore held, then copies its data in without it. Records are thus
+ * never split by other appenders. Readers only see a record once it is
+ * copied: dev->size covers the reservations, but they look at
+ * dev->committed, which only grows, and in order. The reservations
+ * wait in dev->appends; whoever is done copying commits the run of
+ * finished records at the head of the list, its own and those after
+ * it, so that a record never waits for a writer that gave up.
+ * Meanwhile, the quanta are kept in place by holding append_sem for
+ * reading; whoever changes them in any other way takes it for writing.
+ */
+struct scull_append {
+	struct list_head list;
+	loff_t end;
+	int done;                 /* copied in, can be shown */
+};
+
+/*
+ * In a ring, the records in flight must not wrap over each other.
+ */
+static inline int scull_append_fits(struct scull_dev *dev, size_t count)
+{
+	return !dev->ring ||
+		dev->size + count - scull_committed(dev) <= dev->ring;
+}
+
+static void scull_append_done(struct scull_dev *dev, struct scull_append *ap)
+{
+	spin_lock(&dev->append_lock);
+	ap->done = 1;
+	while (!list_empty(&dev->appends)) {
+		ap = list_first_entry(&dev->appends, struct scull_append, list);
+		if (!ap->done)
+			break;
+		scull_commit(dev, ap->end);
+		list_del(&ap->list);
+		kfree(ap);
+	}
+	spin_unlock(&dev->append_lock);
+	wake_up(&dev->inq); /* readers, and the appenders after these */
+}
+
+static ssize_t scull_append(struct scull_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos, ktime_t *locked)
+{
+	struct scull_append *ap;
+	struct scull_qset *dptr;
+	int quantum, s_pos, q_pos, avail, retval;
+	loff_t start, pos;
+	long item;
+	size_t done;
+	void *ptr;
+
+	/* it outlives us if a signal comes: see scull_append_done() */
+	ap = kmalloc(sizeof(struct scull_append), GFP_KERNEL);
+	if (!ap)
+		return -ENOMEM;
+	ap->done = 0;
+	for (;;) {
+		if (down_interruptible(&dev->sem)) {
+			retval = -ERESTARTSYS;
+			goto fail;
+		}
+		*locked = ktime_get();
+		if (dev->ring && count > dev->ring) {
+			retval = -EINVAL; /* it would overwrite itself */
+			goto fail_locked;
+		}
+		if (scull_append_fits(dev, count))
+			break;
+		up(&dev->sem);
+		if (wait_event_interruptible(dev->inq,
+				scull_append_fits(dev, count))) {
+			retval = -ERESTARTSYS;
+			goto fail;
+		}
+	}
+	quantum = dev->quantum;
+	start = dev->size;
+	for (pos = start; pos < start + count; pos += quantum - q_pos) {
+		scull_locate(dev, scull_ring_pos(dev, pos), &item, &s_pos, &q_pos);
+		dptr = scull_follow(dev, item);
+		retval = dptr ? scull_prepare_quantum(dev, dptr, s_pos) : -ENOMEM;
+		if (retval)
+			goto fail_locked;
+	}
+	dev->size = start + count;
+	ap->end = start + count;
+	spin_lock(&dev->append_lock);
+	list_add_tail(&ap->list, &dev->appends);
+	spin_unlock(&dev->append_lock);
+	down_read(&dev->append_sem);
+	up(&dev->sem);
+
+	/* the whole range is there: scull_follow() won't allocate */
+	for (done = 0; done < count; done += avail) {
+		scull_locate(dev, scull_ring_pos(dev, start + done), &item,
+				&s_pos, &q_pos);
+		dptr = scull_follow(dev, item);
+		ptr = scull_quantum_ptr(dev, dptr->data[s_pos], q_pos, &avail);
+		if (avail > count - done)
+			avail = count - done;
+		if (copy_from_user(ptr, buf + done, avail))
+			break;
+	}
+	/*
+	 * A fault leaves the rest of the record as it was, but the later
+	 * ones can't wait forever. Then wait for it to show, as a plain
+	 * write would; a signal only cuts the wait short, as the record
+	 * is in and whoever is before us commits it.
+	 */
+	scull_append_done(dev, ap);
+	wait_event_interruptible(dev->inq,
+			scull_committed(dev) >= start + count);
+	up_read(&dev->append_sem);
+	*f_pos = start + done;
+	if (done == 0 && count)
+		return -EFAULT;
+	return done;
+
+  fail_locked:
+	up(&dev->sem);
+  fail:
+	kfree(ap);
 	return retval;
 }
 
+/*
+ * Whether the user buffer is all zeros, looking at it through a small
+ * bounce buffer; most data gives itself away in the first chunk.
+ */
+static int scull_user_is_zero(const char __user *buf, size_t count)
+{
+	char chunk[128];
+	size_t n;
+
+	for (; count; count -= n, buf += n) {
+		n = min(count, sizeof(chunk));
+		if (copy_from_user(chunk, buf, n))
+			return -EFAULT;
+		if (memchr_inv(chunk, 0, n))
+			return 0;
+	}
+	return 1;
+}
+
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data;
 	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int minor = iminor(filp->f_path.dentry->d_inode);
+	int s_pos, q_pos, avail;
+	long item;
+	ktime_t start, locked;
+	void *ptr;
 	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	/* in case it fails before locking */
+	start = locked = scull_lat_start(SCULL_LAT_WRITE, minor, *f_pos, count);
+	if (filp->f_flags & O_APPEND) {
+		retval = scull_append(dev, buf, count, f_pos, &locked);
+		goto done;
+	}
+
+	if (down_interruptible(&dev->sem)) {
+		retval = -ERESTARTSYS;
+		goto done;
+	}
+	locked = ktime_get();
+	down_write(&dev->append_sem); /* see scull_append() */
+	if (*f_pos < scull_ring_start(dev)) {
+		retval = -EINVAL; /* it's gone, and newer data is there */
+		goto out;
+	}
+	if (dev->ring && *f_pos > dev->size) {
+		/* the gap would show what the ring held a lap ago */
+		retval = -EINVAL;
+		goto out;
+	}
 
 	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	scull_locate(dev, scull_ring_pos(dev, *f_pos), &item, &s_pos, &q_pos);
 
 	/* follow the list up to the right position */
 	dptr = scull_follow(dev, item);
 	if (dptr == NULL)
 		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
+
+	/*
+	 * Writing zeros is a common way to reserve space: into a hole, or
+	 * the zero quantum, they leave just the zero quantum, and there's
+	 * no need for a real one. A ring, instead, is meant to never free
+	 * nor allocate once full.
+	 */
+	if (!dev->ring && (!dptr->data[s_pos] ||
+				dptr->data[s_pos] == &scull_zero_quantum)) {
+		if (count > dev->quantum - q_pos)
+			count = dev->quantum - q_pos;
+		retval = scull_user_is_zero(buf, count);
+		if (retval < 0)
 			goto out;
+		if (retval) {
+			dptr->data[s_pos] = &scull_zero_quantum;
+			goto written;
+		}
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	retval = scull_prepare_quantum(dev, dptr, s_pos);
+	if (retval)
+		goto out;
+	/* write only up to the end of this quantum (or of its page) */
+	ptr = scull_quantum_ptr(dev, dptr->data[s_pos], q_pos, &avail);
+	if (count > avail)
+		count = avail;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
+	if (copy_from_user(ptr, buf, count)) {
 		retval = -EFAULT;
 		goto out;
 	}
+	/*
+	 * Zeros over a whole quantum free it, too; only the data just
+	 * written has to be looked at. Quanta that were preallocated
+	 * stay, as they are about to be written to.
+	 */
+	if (!dev->ring && q_pos == 0 && count == dev->quantum &&
+			!dptr->data[s_pos]->prealloc && !memchr_inv(ptr, 0, count)) {
+		scull_put_quantum(dev, dptr->data[s_pos]);
+		dptr->data[s_pos] = &scull_zero_quantum;
+	}
+  written:
 	*f_pos += count;
 	retval = count;
 
         /* update the size */
-	if (dev->size < *f_pos)
+	if (dev->size < *f_pos) {
 		dev->size = *f_pos;
+		scull_commit(dev, dev->size);
+		wake_up_interruptible(&dev->inq); /* blocked in read() and poll() */
+	}
 
   out:
+	up_write(&dev->append_sem);
+	up(&dev->sem);
+  done:
+	scull_lat_done(SCULL_LAT_WRITE, minor, *f_pos, retval, start, locked);
+	return retval;
+}
+
+/*
+ * Make "dev" a clone of "src": drop its contents, then share all the
+ * quanta of "src" by reference. Quanta are copied by scull_write()
+ * the first time either device writes to them, so a snapshot costs
+ * only the qset arrays. Both semaphores must be held.
+ */
+static int scull_clone(struct scull_dev *dev, struct scull_dev *src)
+{
+	struct scull_qset *sptr, *dptr, **tail;
+	int i;
+
+	/*
+	 * A device with its own slab cache can't free quanta that
+	 * came from the cache of another one.
+	 */
+	if (src->alloc == SCULL_ALLOC_CACHE)
+		return -EINVAL;
+	scull_trim(dev);
+	scull_alloc_release(dev);
+	dev->alloc = src->alloc;
+	dev->quantum = src->quantum;
+	dev->qset = src->qset;
+	dev->ring = src->ring; /* offsets wrap the same way */
+
+	/* appends in flight to "src" would change the clone, too */
+	down_write(&src->append_sem);
+	tail = &dev->data;
+	for (sptr = src->data; sptr; sptr = sptr->next) {
+		dptr = scull_alloc_qset(dev);
+		if (!dptr)
+			goto nomem;
+		*tail = dptr;
+		tail = &dptr->next;
+		for (i = 0; i < src->qset; i++) {
+			dptr->data[i] = sptr->data[i];
+			if (dptr->data[i] && dptr->data[i] != &scull_zero_quantum)
+				atomic_inc(&dptr->data[i]->count);
+		}
+	}
+	up_write(&src->append_sem);
+	dev->size = src->size;
+	scull_commit(dev, dev->size);
+	return 0;
+
+  nomem:
+	up_write(&src->append_sem);
+	scull_trim(dev);
+	return -ENOMEM;
+}
+
+/*
+ * Preallocation, as fallocate() does for files: get every quantum in
+ * the range ready to be written, so that the writes that follow don't
+ * have to allocate. FALLOC_FL_PUNCH_HOLE goes the other way: quanta
+ * entirely in the range become the zero quantum, and the rest of the
+ * range is cleared. Both semaphores are taken here. Rings are left out:
+ * they allocate as they fill up, and never free.
+ */
+static int scull_fallocate(struct scull_dev *dev, int mode, loff_t offset,
+		loff_t len)
+{
+	struct scull_qset *dptr;
+	struct scull_quantum *q;
+	int quantum, s_pos, q_pos, avail, retval = 0;
+	loff_t pos, next, end = offset + len;
+	long item;
+	void *ptr;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+	/* as in do_fallocate(), punching never changes the size */
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0 || end < offset)
+		return -EINVAL;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->ring) {
+		up(&dev->sem);
+		return -EINVAL;
+	}
+	down_write(&dev->append_sem);
+	quantum = dev->quantum;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && end > dev->size)
+		end = dev->size; /* no quanta past the end, nor list items */
+
+	for (pos = offset; pos < end; pos = next) {
+		scull_locate(dev, pos, &item, &s_pos, &q_pos);
+		next = min_t(loff_t, pos - q_pos + quantum, end);
+		dptr = scull_follow(dev, item);
+		if (!dptr) {
+			retval = -ENOMEM;
+			break;
+		}
+		if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+			retval = scull_prepare_quantum(dev, dptr, s_pos);
+			if (retval)
+				break;
+			dptr->data[s_pos]->prealloc = 1;
+			continue;
+		}
+		if (!dptr->data[s_pos] || dptr->data[s_pos] == &scull_zero_quantum)
+			continue; /* nothing to free */
+		if (next - pos == quantum) {
+			scull_put_quantum(dev, dptr->data[s_pos]);
+			dptr->data[s_pos] = &scull_zero_quantum;
+			continue;
+		}
+		retval = scull_prepare_quantum(dev, dptr, s_pos);
+		if (retval)
+			break;
+		for (q = dptr->data[s_pos]; pos < next; pos += avail) {
+			ptr = scull_quantum_ptr(dev, q, q_pos, &avail);
+			if (avail > next - pos)
+				avail = next - pos;
+			memset(ptr, 0, avail);
+			q_pos += avail;
+		}
+	}
+	if (!retval && !(mode & FALLOC_FL_KEEP_SIZE) && dev->size < end) {
+		dev->size = end;
+		scull_commit(dev, end);
+		wake_up_interruptible(&dev->inq);
+	}
+	up_write(&dev->append_sem);
 	up(&dev->sem);
 	return retval;
 }
 
+/*
+ * SCULL_IOCBATCH: saves a system call per command, for the tools
+ * that set up many devices.
+ */
+static long scull_batch(struct file *filp, struct scull_batch __user *ubatch)
+{
+	struct scull_batch batch;
+	struct scull_batch_op op;
+	int i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nops < 0)
+		return -EINVAL;
+	for (i = 0; i < batch.nops; i++) {
+		if (copy_from_user(&op, batch.ops + i, sizeof(op)))
+			return i ? i : -EFAULT;
+		if (op.cmd == SCULL_IOCBATCH)
+			op.result = -EINVAL; /* no nesting */
+		else
+			op.result = scull_ioctl(filp, op.cmd, op.arg);
+		if (put_user(op.result, &batch.ops[i].result))
+			return i ? i : -EFAULT;
+		if (op.result < 0)
+			break;
+		cond_resched();
+	}
+	return i;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -394,6 +1041,10 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct scull_dev *dev = filp->private_data, *src, *first, *second;
+	struct scull_falloc falloc;
+	struct scull_window window;
+	struct file *srcfilp;
 	int err = 0, tmp;
 	int retval = 0;
     
@@ -506,6 +1157,161 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	/*
+	 * The allocator is a property of the bare device; scullpipe
+	 * shares this method, but has no quanta.
+	 */
+	  case SCULL_IOCTALLOC:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_set_alloc(dev, arg);
+		up(&dev->sem);
+		break;
+
+	  case SCULL_IOCQALLOC:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		return dev->alloc;
+
+	  case SCULL_IOCCLONE: /* Tell: arg is the fd of the source */
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		srcfilp = fget(arg);
+		if (!srcfilp)
+			return -EBADF;
+		src = srcfilp->private_data;
+		if (srcfilp->f_op->read != scull_read ||
+				!(srcfilp->f_mode & FMODE_READ) || src == dev) {
+			fput(srcfilp);
+			return -EINVAL;
+		}
+		/* always lock the two devices in the same order */
+		first = dev < src ? dev : src;
+		second = dev < src ? src : dev;
+		retval = -ERESTARTSYS;
+		if (down_interruptible(&first->sem))
+			goto clone_out;
+		if (down_interruptible(&second->sem)) {
+			up(&first->sem);
+			goto clone_out;
+		}
+		retval = scull_clone(dev, src);
+		up(&second->sem);
+		up(&first->sem);
+	  clone_out:
+		fput(srcfilp);
+		break;
+
+	  case SCULL_IOCTCOLD:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if ((long) arg < 0 || arg > INT_MAX / HZ)
+			return -EINVAL;
+		dev->cold = arg;
+		break;
+
+	  case SCULL_IOCQCOLD:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		return dev->cold;
+
+	  case SCULL_IOCGZSTATS:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		if (copy_to_user((void __user *)arg, &dev->zstats,
+					sizeof(dev->zstats)))
+			retval = -EFAULT;
+		up(&dev->sem);
+		break;
+
+	/*
+	 * The VFS only passes fallocate() down to regular files and
+	 * directories, so the device offers the same thing here.
+	 */
+	  case SCULL_IOCFALLOC:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&falloc, (void __user *)arg, sizeof(falloc)))
+			return -EFAULT;
+		retval = scull_fallocate(dev, falloc.mode, falloc.offset,
+				falloc.len);
+		break;
+
+	  case SCULL_IOCTRING:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		if (dev->data)
+			retval = -EBUSY; /* trim it first, as for the allocator */
+		else
+			dev->ring = roundup(arg, dev->quantum);
+		up(&dev->sem);
+		break;
+
+	  case SCULL_IOCQRING:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		return dev->ring;
+
+	  case SCULL_IOCTFOLLOW:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		spin_lock(&filp->f_lock);
+		if (arg)
+			filp->f_flags |= SCULL_F_FOLLOW;
+		else
+			filp->f_flags &= ~SCULL_F_FOLLOW;
+		spin_unlock(&filp->f_lock);
+		wake_up_interruptible(&dev->inq); /* readers may return now */
+		break;
+
+	  case SCULL_IOCQFOLLOW:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		return scull_following(filp);
+
+	  case SCULL_IOCGWINDOW:
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		window.start = scull_ring_start(dev);
+		window.end = scull_committed(dev);
+		up(&dev->sem);
+		if (copy_to_user((void __user *)arg, &window, sizeof(window)))
+			retval = -EFAULT;
+		break;
+
+	  case SCULL_IOCBATCH:
+		return scull_batch(filp, (struct scull_batch __user *)arg);
+
+	  case SCULL_IOCTRIM: /* what a write-only open does */
+		if (filp->f_op->read != scull_read)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		scull_trim(dev);
+		up(&dev->sem);
+		wake_up_interruptible(&dev->inq);
+		break;
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -547,12 +1353,30 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 }
 
 
+/*
+ * Readable when there is data past our position; with follow mode
+ * off, the end of the device is readable too, as for regular files.
+ */
+static unsigned int scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_dev *dev = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM; /* always writable */
+
+	down(&dev->sem);
+	poll_wait(filp, &dev->inq, wait);
+	if (filp->f_pos < scull_committed(dev) || !scull_following(filp))
+		mask |= POLLIN | POLLRDNORM;
+	up(&dev->sem);
+	return mask;
+}
+
 
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
 	.read =     scull_read,
 	.write =    scull_write,
+	.poll =     scull_poll,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_open,
 	.release =  scull_release,
@@ -569,17 +1393,17 @@ struct file_operations scull_fops = {
  */
 void scull_cleanup_module(void)
 {
-	int i;
+	struct scull_dev *dev;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* stop the compressor before the devices go */
+	scull_cold_cleanup();
+	scull_lat_cleanup();
+
 	/* Get rid of our char dev entries */
-	if (scull_devices) {
-		for (i = 0; i < scull_nr_devs; i++) {
-			scull_trim(scull_devices + i);
-			cdev_del(&scull_devices[i].cdev);
-		}
-		kfree(scull_devices);
-	}
+	cdev_del(&scull_cdev);
+	while (radix_tree_gang_lookup(&scull_devtree, (void **)&dev, 0, 1))
+		scull_free_dev(dev);
 
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 	scull_remove_proc();
@@ -596,24 +1420,24 @@ void scull_cleanup_module(void)
 
 
 /*
- * Set up the char_dev structure for this device.
+ * Set up the char_dev structure for all the bare devices.
  */
-static void scull_setup_cdev(struct scull_dev *dev, int index)
+static void scull_setup_cdev(void)
 {
-	int err, devno = MKDEV(scull_major, scull_minor + index);
+	int err, devno = MKDEV(scull_major, scull_minor);
     
-	cdev_init(&dev->cdev, &scull_fops);
-	dev->cdev.owner = THIS_MODULE;
-	err = cdev_add(&dev->cdev, devno, 1);
+	cdev_init(&scull_cdev, &scull_fops);
+	scull_cdev.owner = THIS_MODULE;
+	err = cdev_add(&scull_cdev, devno, scull_nr_devs);
 	/* Fail gracefully if need be */
 	if (err)
-		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+		printk(KERN_NOTICE "Error %d adding scull", err);
 }
 
 
 int scull_init_module(void)
 {
-	int result, i;
+	int result;
 	dev_t dev = 0;
 
 /*
@@ -633,24 +1457,20 @@ int scull_init_module(void)
 		return result;
 	}
 
-        /* 
-	 * allocate the devices -- we can't have them static, as the number
-	 * can be specified at load time
-	 */
-	scull_devices = kmalloc(scull_nr_devs * sizeof(struct scull_dev), GFP_KERNEL);
-	if (!scull_devices) {
-		result = -ENOMEM;
-		goto fail;  /* Make this more graceful */
+	if (scull_alloc < 0 || scull_alloc >= SCULL_ALLOC_NR) {
+		printk(KERN_NOTICE "scull: bad allocator %d, using kmalloc\n",
+				scull_alloc);
+		scull_alloc = SCULL_ALLOC_KMALLOC;
 	}
-	memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
-        /* Initialize each device. */
-	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset = scull_qset;
-		sema_init(&scull_devices[i].sem, 1);
-		scull_setup_cdev(&scull_devices[i], i);
-	}
+	/* the compressor can fail; it goes first, before any device */
+	result = scull_cold_init();
+	if (result)
+		goto fail_cold;
+
+        /* The devices themselves are created at open time */
+	scull_setup_cdev();
+	scull_lat_init();
 
         /* At this point call the init function for any friend device */
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
@@ -663,8 +1483,8 @@ int scull_init_module(void)
 
 	return 0; /* succeed */
 
-  fail:
-	scull_cleanup_module();
+  fail_cold:
+	unregister_chrdev_region(dev, scull_nr_devs);
 	return result;
 }
 
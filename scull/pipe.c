@@ -28,6 +28,7 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
 
 #include "scull.h"		/* local definitions */
 
@@ -120,20 +121,28 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
+	int minor = iminor(filp->f_path.dentry->d_inode);
+	ktime_t start, locked;
+	ssize_t retval = -ERESTARTSYS;
 
+	/* every start event gets its done event, whatever happens */
+	start = locked = scull_lat_start(SCULL_LAT_P_READ, minor, *f_pos, count);
 	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+		goto done;
+	locked = ktime_get();
 
 	while (dev->rp == dev->wp) { /* nothing to read */
 		up(&dev->sem); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+		if (filp->f_flags & O_NONBLOCK) {
+			retval = -EAGAIN;
+			goto done;
+		}
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
 		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+			goto done; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
 		if (down_interruptible(&dev->sem))
-			return -ERESTARTSYS;
+			goto done;
 	}
 	/* ok, data is there, return something */
 	if (dev->wp > dev->rp)
@@ -142,7 +151,8 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 		count = min(count, (size_t)(dev->end - dev->rp));
 	if (copy_to_user(buf, dev->rp, count)) {
 		up (&dev->sem);
-		return -EFAULT;
+		retval = -EFAULT;
+		goto done;
 	}
 	dev->rp += count;
 	if (dev->rp == dev->end)
@@ -152,7 +162,11 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 	/* finally, awake any writers and return */
 	wake_up_interruptible(&dev->outq);
 	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
+	retval = count;
+
+  done:
+	scull_lat_done(SCULL_LAT_P_READ, minor, *f_pos, retval, start, locked);
+	return retval;
 }
 
 /* Wait for space for writing; caller must hold device semaphore.  On
@@ -190,15 +204,19 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
-	int result;
+	int minor = iminor(filp->f_path.dentry->d_inode);
+	ktime_t start, locked;
+	ssize_t retval = -ERESTARTSYS;
 
+	start = locked = scull_lat_start(SCULL_LAT_P_WRITE, minor, *f_pos, count);
 	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+		goto done;
+	locked = ktime_get();
 
 	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
-	if (result)
-		return result; /* scull_getwritespace called up(&dev->sem) */
+	retval = scull_getwritespace(dev, filp);
+	if (retval)
+		goto done; /* scull_getwritespace called up(&dev->sem) */
 
 	/* ok, space is there, accept something */
 	count = min(count, (size_t)spacefree(dev));
@@ -209,7 +227,8 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
 	if (copy_from_user(dev->wp, buf, count)) {
 		up (&dev->sem);
-		return -EFAULT;
+		retval = -EFAULT;
+		goto done;
 	}
 	dev->wp += count;
 	if (dev->wp == dev->end)
@@ -223,7 +242,11 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	if (dev->async_queue)
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
 	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
+	retval = count;
+
+  done:
+	scull_lat_done(SCULL_LAT_P_WRITE, minor, *f_pos, retval, start, locked);
+	return retval;
 }
 
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
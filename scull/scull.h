@@ -20,6 +20,9 @@
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
 
+struct kmem_cache;
+struct scull_qset_cache;
+
 /*
  * Macros to help debugging
  */
@@ -77,20 +80,65 @@
 #endif
 
 /*
- * Representation of scull quantum sets.
+ * Representation of scull quantum sets. The array comes in the same
+ * allocation as the list item, see scull_alloc_qset().
  */
 struct scull_qset {
-	void **data;
 	struct scull_qset *next;
+	struct scull_quantum *data[0];
+};
+
+/*
+ * A quantum. Clones of a device share quanta until they are written
+ * (see SCULL_IOCCLONE), hence the reference count. The memory comes
+ * from the allocator of the device, see alloc.c. A quantum left
+ * alone for long enough is compressed (see compress.c): then "mem"
+ * is NULL and the data lives in "zdata". Quanta of zeros are shared
+ * as scull_zero_quantum, which has neither.
+ */
+struct scull_quantum {
+	atomic_t count;           /* devices using it */
+	void *mem;
+	unsigned long atime;      /* jiffies at last access */
+	void *zdata;              /* compressed contents, or NULL */
+	size_t zlen;
+	int prealloc;             /* by SCULL_IOCFALLOC: keep it, even if zero */
+};
+
+/*
+ * Compression statistics, returned by SCULL_IOCGZSTATS.
+ */
+struct scull_zstats {
+	unsigned long compressions;
+	unsigned long bytes_in;   /* the ratio is bytes_in / bytes_out */
+	unsigned long bytes_out;
+	unsigned long decompressions;
+	unsigned long long decomp_ns;     /* total time decompressing */
+	unsigned long long decomp_max_ns;
 };
 
 struct scull_dev {
 	struct scull_qset *data;  /* Pointer to first quantum set */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
-	unsigned long size;       /* amount of data stored here */
+	loff_t size;              /* amount of data stored here */
+	atomic64_t committed;     /* what readers see, see scull_append() */
+	unsigned long ring;       /* ring size, or 0; see scull_ring_pos() */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
+	int index;                /* minor less scull_minor, for bare devices */
+	int users;                /* open files and other references */
+	int alloc;                /* quantum allocator, SCULL_ALLOC_* */
+	struct kmem_cache *cache; /* for SCULL_ALLOC_CACHE, see alloc.c */
+	int cache_size;           /* object size of "cache" */
+	char cache_name[24];
+	struct scull_qset_cache *qcache; /* where list items come from */
+	int cold;                 /* seconds before compressing; 0: never */
+	struct scull_zstats zstats;
 	struct semaphore sem;     /* mutual exclusion semaphore     */
+	struct rw_semaphore append_sem; /* keeps quanta in place, see scull_append() */
+	struct list_head appends; /* appends in flight, oldest first */
+	spinlock_t append_lock;   /* protects the list above */
+	wait_queue_head_t inq;    /* readers waiting in follow mode */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,9 +156,16 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern unsigned long scull_ring;
 
 extern int scull_p_buffer;	/* pipe.c */
 
+extern int scull_alloc;		/* alloc.c */
+extern struct scull_quantum scull_zero_quantum;
+
+extern int scull_cold;		/* compress.c */
+
+
 
 /*
  * Prototypes for shared functions
@@ -122,6 +177,41 @@ int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
+void    scull_for_each_dev(void (*fn)(struct scull_dev *dev));
+
+void   *scull_alloc_mem(struct scull_dev *dev);
+void    scull_free_mem(struct scull_dev *dev, void *mem);
+void   *scull_mem_ptr(struct scull_dev *dev, void *mem, int q_pos, int *avail);
+struct scull_qset *scull_alloc_qset(struct scull_dev *dev);
+void    scull_free_qset(struct scull_dev *dev, struct scull_qset *qs);
+struct scull_quantum *scull_alloc_quantum(struct scull_dev *dev);
+struct scull_quantum *scull_unshare_quantum(struct scull_dev *dev,
+                          struct scull_quantum *quantum);
+void    scull_put_quantum(struct scull_dev *dev, struct scull_quantum *quantum);
+void   *scull_quantum_ptr(struct scull_dev *dev, struct scull_quantum *quantum,
+                          int q_pos, int *avail);
+const char *scull_alloc_name(struct scull_dev *dev);
+void    scull_alloc_release(struct scull_dev *dev);
+int     scull_set_alloc(struct scull_dev *dev, int alloc);
+
+/*
+ * Latency measurement, see latency.c
+ */
+#define SCULL_LAT_READ    0
+#define SCULL_LAT_WRITE   1
+#define SCULL_LAT_P_READ  2
+#define SCULL_LAT_P_WRITE 3
+#define SCULL_LAT_NR      4
+
+void    scull_lat_init(void);
+void    scull_lat_cleanup(void);
+ktime_t scull_lat_start(int op, int minor, loff_t pos, size_t count);
+void    scull_lat_done(int op, int minor, loff_t pos, ssize_t ret,
+                       ktime_t start, ktime_t locked);
+
+int     scull_cold_init(void);
+void    scull_cold_cleanup(void);
+int     scull_touch_quantum(struct scull_dev *dev, struct scull_quantum *quantum);
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
@@ -169,8 +259,91 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * The quantum allocator is chosen per device, and only while
+ * the device is empty.
+ */
+#define SCULL_ALLOC_KMALLOC   0
+#define SCULL_ALLOC_CACHE     1
+#define SCULL_ALLOC_PAGES     2
+#define SCULL_ALLOC_VMALLOC   3
+#define SCULL_ALLOC_PAGEARRAY 4
+#define SCULL_ALLOC_NR        5
+
+#define SCULL_IOCTALLOC  _IO(SCULL_IOC_MAGIC,   15)
+#define SCULL_IOCQALLOC  _IO(SCULL_IOC_MAGIC,   16)
+
+/*
+ * Make this device a copy-on-write clone of another scull device,
+ * whose file descriptor is the argument.
+ */
+#define SCULL_IOCCLONE   _IO(SCULL_IOC_MAGIC,   17)
+
+/*
+ * Compression of cold quanta: the delay in seconds (0 disables it),
+ * and the statistics of the device.
+ */
+#define SCULL_IOCTCOLD   _IO(SCULL_IOC_MAGIC,   18)
+#define SCULL_IOCQCOLD   _IO(SCULL_IOC_MAGIC,   19)
+#define SCULL_IOCGZSTATS _IOR(SCULL_IOC_MAGIC,  20, struct scull_zstats)
+
+/*
+ * Preallocate, or punch a hole in, a range of the device. The mode
+ * takes the FALLOC_FL_* flags of fallocate(2).
+ */
+struct scull_falloc {
+	int mode;
+	long long offset;
+	long long len;
+};
+
+#define SCULL_IOCFALLOC  _IOW(SCULL_IOC_MAGIC,  21, struct scull_falloc)
+
+/*
+ * Ring mode: the device keeps only the last "ring" bytes written
+ * (0 turns it off; the device must be empty to change it). The
+ * window is the range of offsets that can still be read.
+ */
+struct scull_window {
+	long long start;
+	long long end;
+};
+
+#define SCULL_IOCTRING   _IO(SCULL_IOC_MAGIC,   22)
+#define SCULL_IOCQRING   _IO(SCULL_IOC_MAGIC,   23)
+#define SCULL_IOCGWINDOW _IOR(SCULL_IOC_MAGIC,  24, struct scull_window)
+
+/*
+ * Follow mode, like "tail -f": reads at the end of the device wait
+ * for writers instead of returning 0. It is set for the open file
+ * only, as O_NONBLOCK is.
+ */
+#define SCULL_IOCTFOLLOW _IO(SCULL_IOC_MAGIC,   25)
+#define SCULL_IOCQFOLLOW _IO(SCULL_IOC_MAGIC,   26)
+
+/*
+ * Run several of the commands above in one system call. They are
+ * executed in order, each one with the "arg" it would get from
+ * ioctl(); "result" gets what ioctl() would return. Execution stops
+ * at the first failure, and the number of commands that succeeded is
+ * returned.
+ */
+struct scull_batch_op {
+	unsigned int cmd;
+	unsigned long arg;
+	long result;
+};
+
+struct scull_batch {
+	int nops;
+	struct scull_batch_op __user *ops;
+};
+
+#define SCULL_IOCBATCH   _IOW(SCULL_IOC_MAGIC,  27, struct scull_batch)
+#define SCULL_IOCTRIM    _IO(SCULL_IOC_MAGIC,   28)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 28
 
 #endif /* _SCULL_H_ */
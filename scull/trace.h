@@ -0,0 +1,95 @@
+/*
+ * trace.h -- tracepoints for the scull module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#define show_scull_op(op)					\
+	__print_symbolic(op,					\
+		{ SCULL_LAT_READ,    "read" },			\
+		{ SCULL_LAT_WRITE,   "write" },			\
+		{ SCULL_LAT_P_READ,  "pipe_read" },		\
+		{ SCULL_LAT_P_WRITE, "pipe_write" })
+
+TRACE_EVENT(scull_io_start,
+
+	TP_PROTO(int op, int minor, loff_t pos, size_t count),
+
+	TP_ARGS(op, minor, pos, count),
+
+	TP_STRUCT__entry(
+		__field(int,	op)
+		__field(int,	minor)
+		__field(loff_t,	pos)
+		__field(size_t,	count)
+	),
+
+	TP_fast_assign(
+		__entry->op	= op;
+		__entry->minor	= minor;
+		__entry->pos	= pos;
+		__entry->count	= count;
+	),
+
+	TP_printk("%s minor=%d pos=%lld count=%zu",
+		show_scull_op(__entry->op), __entry->minor,
+		(long long)__entry->pos, __entry->count)
+);
+
+TRACE_EVENT(scull_io_done,
+
+	TP_PROTO(int op, int minor, loff_t pos, ssize_t ret, s64 wait_ns,
+		s64 total_ns),
+
+	TP_ARGS(op, minor, pos, ret, wait_ns, total_ns),
+
+	TP_STRUCT__entry(
+		__field(int,	op)
+		__field(int,	minor)
+		__field(loff_t,	pos)
+		__field(ssize_t, ret)
+		__field(s64,	wait_ns)
+		__field(s64,	total_ns)
+	),
+
+	TP_fast_assign(
+		__entry->op	  = op;
+		__entry->minor	  = minor;
+		__entry->pos	  = pos;
+		__entry->ret	  = ret;
+		__entry->wait_ns  = wait_ns;
+		__entry->total_ns = total_ns;
+	),
+
+	TP_printk("%s minor=%d pos=%lld ret=%zd lock_wait=%lldns total=%lldns",
+		show_scull_op(__entry->op), __entry->minor,
+		(long long)__entry->pos, __entry->ret,
+		(long long)__entry->wait_ns, (long long)__entry->total_ns)
+);
+
+#endif /* _SCULL_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
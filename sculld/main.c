@@ -26,6 +26,8 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
 #include <asm/uaccess.h>
 #include "sculld.h"		/* local definitions */
 
@@ -34,11 +36,15 @@ int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_numa =    SCULLD_NUMA_LOCAL;	/* NUMA policy of new devices */
+int sculld_node =    0;		/* and node, for SCULLD_NUMA_NODE */
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
+module_param(sculld_numa, int, 0);
+module_param(sculld_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -98,6 +104,7 @@ int sculld_read_procmem(char *buf, char **start, off_t offset,
 		order = d->order;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		len += scull_pages_proc(d->pages, buf+len);
 		for (; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			sculld_proc_offset (buf, start, &offset, &len);
@@ -169,6 +176,36 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Quanta are handled by scullpages.h; the list items only give it
+ * their arrays.
+ */
+static int sculld_alloc_quantum(struct sculld_dev *dev, struct sculld_dev *dptr,
+		int s_pos)
+{
+	return scull_pages_alloc_quantum(dev->pages, dev->order, dev->qset,
+			dptr->data, &dptr->orders, s_pos);
+}
+
+static void sculld_free_quantum(struct sculld_dev *dev, struct sculld_dev *dptr,
+		int s_pos)
+{
+	scull_pages_free_quantum(dev->pages, dev->order, dptr->data,
+			dptr->orders, s_pos);
+}
+
+/*
+ * Return the address of byte "q_pos" in quantum "s_pos" of the list
+ * item "dptr", and in *avail how many bytes are contiguous from there.
+ * Used by read, write and mmap: the quantum must be present.
+ */
+void *sculld_quantum_ptr(struct sculld_dev *dev, struct sculld_dev *dptr,
+		int s_pos, int q_pos, int *avail)
+{
+	return scull_pages_ptr(dev->order, dptr->data, dptr->orders, s_pos,
+			q_pos, avail);
+}
+
 /*
  * Data management: read and write
  */
@@ -181,7 +218,8 @@ ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, avail;
+	void *ptr;
 	ssize_t retval = 0;
 
 	if (down_interruptible (&dev->sem))
@@ -202,10 +240,11 @@ ssize_t sculld_read (struct file *filp, char __user *buf, size_t count,
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
+	ptr = sculld_quantum_ptr(dev, dptr, s_pos, q_pos, &avail);
+	if (count > avail)
+		count = avail; /* read only up to the end of this block */
 
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
+	if (copy_to_user (buf, ptr, count)) {
 		retval = -EFAULT;
 		goto nothing;
 	}
@@ -229,7 +268,8 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, avail;
+	void *ptr;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (down_interruptible (&dev->sem))
@@ -250,15 +290,13 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
+		if (sculld_alloc_quantum(dev, dptr, s_pos))
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
+	ptr = sculld_quantum_ptr(dev, dptr, s_pos, q_pos, &avail);
+	if (count > avail)
+		count = avail; /* write only up to the end of this block */
+	if (copy_from_user (ptr, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
@@ -282,6 +320,8 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct sculld_dev *dev = filp->private_data;
+	struct sculld_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -306,6 +346,8 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	case SCULLD_IOCRESET:
 		sculld_qset = SCULLD_QSET;
 		sculld_order = SCULLD_ORDER;
+		sculld_numa = SCULLD_NUMA_LOCAL;
+		sculld_node = 0;
 		break;
 
 	case SCULLD_IOCSORDER: /* Set: arg points to the value */
@@ -362,6 +404,30 @@ long sculld_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		sculld_qset = arg;
 		return tmp;
 
+	case SCULLD_IOCSNUMA: /* These two act on this device only */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *) arg, sizeof(numa)))
+			return -EFAULT;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		ret = scull_pages_set_numa(dev->pages, numa.policy, numa.node);
+		up (&dev->sem);
+		break;
+
+	case SCULLD_IOCGNUMA:
+		numa.policy = dev->pages->numa_policy;
+		numa.node = dev->pages->numa_node;
+		if (copy_to_user((void __user *) arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
+	case SCULLD_IOCGHIST:
+		if (copy_to_user((void __user *) arg, dev->pages->order_hist,
+					sizeof(dev->pages->order_hist)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -509,15 +575,17 @@ int sculld_trim(struct sculld_dev *dev)
 			/* This code frees a whole quantum-set */
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+					sculld_free_quantum(dev, dptr, i);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
+			kfree(dptr->orders);
+			dptr->orders=NULL;
 		}
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	scull_pages_trim(dev->pages);
 	dev->size = 0;
 	dev->qset = sculld_qset;
 	dev->order = sculld_order;
@@ -567,6 +635,8 @@ int sculld_init(void)
 {
 	int result, i;
 	dev_t dev = MKDEV(sculld_major, 0);
+
+	BUILD_BUG_ON(MAX_ORDER > SCULLD_NR_ORDERS);
 	
 	/*
 	 * Register your major, and accept a dynamic number.
@@ -595,9 +665,23 @@ int sculld_init(void)
 		goto fail_malloc;
 	}
 	memset(sculld_devices, 0, sculld_devs*sizeof (struct sculld_dev));
+	if (sculld_numa == SCULLD_NUMA_NODE && (sculld_node < 0 ||
+			sculld_node >= MAX_NUMNODES || !node_online(sculld_node))) {
+		printk(KERN_NOTICE "sculld: node %i is not online, using local\n",
+				sculld_node);
+		sculld_numa = SCULLD_NUMA_LOCAL;
+	}
 	for (i = 0; i < sculld_devs; i++) {
 		sculld_devices[i].order = sculld_order;
 		sculld_devices[i].qset = sculld_qset;
+		sculld_devices[i].pages = scull_pages_create();
+		if (!sculld_devices[i].pages) {
+			result = -ENOMEM;
+			goto fail_nodes;
+		}
+		/* a bad policy leaves it local */
+		scull_pages_set_numa(sculld_devices[i].pages, sculld_numa,
+				sculld_node);
 		sema_init (&sculld_devices[i].sem, 1);
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
@@ -607,8 +691,17 @@ int sculld_init(void)
 #ifdef SCULLD_USE_PROC /* only when available */
 	create_proc_read_entry("sculldmem", 0, NULL, sculld_read_procmem, NULL);
 #endif
+	sculld_vm_init();
 	return 0; /* succeed */
 
+  fail_nodes:
+	while (i--) {
+		unregister_ldd_device(&sculld_devices[i].ldev);
+		cdev_del(&sculld_devices[i].cdev);
+		kfree(sculld_devices[i].pages);
+	}
+	kfree(sculld_devices);
+	unregister_ldd_driver(&sculld_driver);
   fail_malloc:
 	unregister_chrdev_region(dev, sculld_devs);
 	return result;
@@ -623,11 +716,13 @@ void sculld_cleanup(void)
 #ifdef SCULLD_USE_PROC
 	remove_proc_entry("sculldmem", NULL);
 #endif
+	sculld_vm_cleanup();
 
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
 		sculld_trim(sculld_devices + i);
+		kfree(sculld_devices[i].pages);
 	}
 	kfree(sculld_devices);
 	unregister_ldd_driver(&sculld_driver);
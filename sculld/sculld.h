@@ -17,6 +17,7 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include "../include/lddbus.h"
+#include "../include/scullpages.h"
 
 /*
  * Macros to help debugging
@@ -54,13 +55,30 @@
 #define SCULLD_ORDER    0 /* one page at a time */
 #define SCULLD_QSET     500
 
+/*
+ * Quanta of this order or more are mapped in full when the device is
+ * mmapped, rather than faulted in one page at a time. PMD_SHIFT makes
+ * it 2MB on x86-64, the size the hardware could map with one entry.
+ */
+#define SCULLD_HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
+
+/*
+ * NUMA placement and fallback to lower orders: see scullpages.h
+ */
+#define SCULLD_NUMA_LOCAL       SCULL_NUMA_LOCAL
+#define SCULLD_NUMA_NODE        SCULL_NUMA_NODE
+#define SCULLD_NUMA_INTERLEAVE  SCULL_NUMA_INTERLEAVE
+#define SCULLD_NR_ORDERS        SCULL_NR_ORDERS
+
 struct sculld_dev {
 	void **data;
+	unsigned char *orders;    /* order of each quantum, if not all "order" */
 	struct sculld_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct scull_pages *pages; /* placement and usage, head only */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 	char devname[20];
@@ -78,12 +96,18 @@ extern int sculld_major;     /* main.c */
 extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern int sculld_numa;
+extern int sculld_node;
 
 /*
  * Prototypes for shared functions
  */
 int sculld_trim(struct sculld_dev *dev);
+void sculld_vm_init(void);		/* mmap.c */
+void sculld_vm_cleanup(void);
 struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
+void *sculld_quantum_ptr(struct sculld_dev *dev, struct sculld_dev *dptr,
+		int s_pos, int q_pos, int *avail);
 
 
 #ifdef SCULLD_DEBUG
@@ -120,7 +144,21 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 #define SCULLD_IOCXQSET    _IOWR(SCULLD_IOC_MAGIC,11, int)
 #define SCULLD_IOCHQSET    _IO(SCULLD_IOC_MAGIC,  12)
 
-#define SCULLD_IOC_MAXNR 12
+/*
+ * NUMA placement is per device, and takes effect with the next
+ * quantum allocated.
+ */
+struct sculld_numa {
+	int policy;               /* SCULLD_NUMA_* */
+	int node;                 /* only used by SCULLD_NUMA_NODE */
+};
+#define SCULLD_IOCSNUMA    _IOW(SCULLD_IOC_MAGIC, 13, struct sculld_numa)
+#define SCULLD_IOCGNUMA    _IOR(SCULLD_IOC_MAGIC, 14, struct sculld_numa)
+
+/* How many quanta were allocated at each order, since the last trim */
+#define SCULLD_IOCGHIST    _IOR(SCULLD_IOC_MAGIC, 15, __u64[SCULLD_NR_ORDERS])
+
+#define SCULLD_IOC_MAXNR 15
 
 
 
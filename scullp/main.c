@@ -26,6 +26,8 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
 #include <asm/uaccess.h>
 #include "scullp.h"		/* local definitions */
 
@@ -34,11 +36,15 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_numa =    SCULLP_NUMA_LOCAL;	/* NUMA policy of new devices */
+int scullp_node =    0;		/* and node, for SCULLP_NUMA_NODE */
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_numa, int, 0);
+module_param(scullp_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -89,6 +95,7 @@ int scullp_read_procmem(char *buf, char **start, off_t offset,
 		order = d->order;
 		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
+		len += scull_pages_proc(d->pages, buf+len);
 		for (; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			scullp_proc_offset (buf, start, &offset, &len);
@@ -160,6 +167,36 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Quanta are handled by scullpages.h; the list items only give it
+ * their arrays.
+ */
+static int scullp_alloc_quantum(struct scullp_dev *dev, struct scullp_dev *dptr,
+		int s_pos)
+{
+	return scull_pages_alloc_quantum(dev->pages, dev->order, dev->qset,
+			dptr->data, &dptr->orders, s_pos);
+}
+
+static void scullp_free_quantum(struct scullp_dev *dev, struct scullp_dev *dptr,
+		int s_pos)
+{
+	scull_pages_free_quantum(dev->pages, dev->order, dptr->data,
+			dptr->orders, s_pos);
+}
+
+/*
+ * Return the address of byte "q_pos" in quantum "s_pos" of the list
+ * item "dptr", and in *avail how many bytes are contiguous from there.
+ * Used by read, write and mmap: the quantum must be present.
+ */
+void *scullp_quantum_ptr(struct scullp_dev *dev, struct scullp_dev *dptr,
+		int s_pos, int q_pos, int *avail)
+{
+	return scull_pages_ptr(dev->order, dptr->data, dptr->orders, s_pos,
+			q_pos, avail);
+}
+
 /*
  * Data management: read and write
  */
@@ -172,7 +209,8 @@ ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, avail;
+	void *ptr;
 	ssize_t retval = 0;
 
 	if (down_interruptible (&dev->sem))
@@ -193,10 +231,11 @@ ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* read only up to the end of this quantum */
+	ptr = scullp_quantum_ptr(dev, dptr, s_pos, q_pos, &avail);
+	if (count > avail)
+		count = avail; /* read only up to the end of this block */
 
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
+	if (copy_to_user (buf, ptr, count)) {
 		retval = -EFAULT;
 		goto nothing;
 	}
@@ -220,7 +259,8 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, avail;
+	void *ptr;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (down_interruptible (&dev->sem))
@@ -241,15 +281,13 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
+		if (scullp_alloc_quantum(dev, dptr, s_pos))
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
+	ptr = scullp_quantum_ptr(dev, dptr, s_pos, q_pos, &avail);
+	if (count > avail)
+		count = avail; /* write only up to the end of this block */
+	if (copy_from_user (ptr, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
@@ -273,6 +311,8 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct scullp_dev *dev = filp->private_data;
+	struct scullp_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -297,6 +337,8 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 	case SCULLP_IOCRESET:
 		scullp_qset = SCULLP_QSET;
 		scullp_order = SCULLP_ORDER;
+		scullp_numa = SCULLP_NUMA_LOCAL;
+		scullp_node = 0;
 		break;
 
 	case SCULLP_IOCSORDER: /* Set: arg points to the value */
@@ -353,6 +395,30 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullp_qset = arg;
 		return tmp;
 
+	case SCULLP_IOCSNUMA: /* These two act on this device only */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *) arg, sizeof(numa)))
+			return -EFAULT;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		ret = scull_pages_set_numa(dev->pages, numa.policy, numa.node);
+		up (&dev->sem);
+		break;
+
+	case SCULLP_IOCGNUMA:
+		numa.policy = dev->pages->numa_policy;
+		numa.node = dev->pages->numa_node;
+		if (copy_to_user((void __user *) arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
+	case SCULLP_IOCGHIST:
+		if (copy_to_user((void __user *) arg, dev->pages->order_hist,
+					sizeof(dev->pages->order_hist)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -500,15 +566,17 @@ int scullp_trim(struct scullp_dev *dev)
 			/* This code frees a whole quantum-set */
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+					scullp_free_quantum(dev, dptr, i);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
+			kfree(dptr->orders);
+			dptr->orders=NULL;
 		}
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	scull_pages_trim(dev->pages);
 	dev->size = 0;
 	dev->qset = scullp_qset;
 	dev->order = scullp_order;
@@ -540,6 +608,8 @@ int scullp_init(void)
 {
 	int result, i;
 	dev_t dev = MKDEV(scullp_major, 0);
+
+	BUILD_BUG_ON(MAX_ORDER > SCULLP_NR_ORDERS);
 	
 	/*
 	 * Register your major, and accept a dynamic number.
@@ -564,9 +634,23 @@ int scullp_init(void)
 		goto fail_malloc;
 	}
 	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
+	if (scullp_numa == SCULLP_NUMA_NODE && (scullp_node < 0 ||
+			scullp_node >= MAX_NUMNODES || !node_online(scullp_node))) {
+		printk(KERN_NOTICE "scullp: node %i is not online, using local\n",
+				scullp_node);
+		scullp_numa = SCULLP_NUMA_LOCAL;
+	}
 	for (i = 0; i < scullp_devs; i++) {
 		scullp_devices[i].order = scullp_order;
 		scullp_devices[i].qset = scullp_qset;
+		scullp_devices[i].pages = scull_pages_create();
+		if (!scullp_devices[i].pages) {
+			result = -ENOMEM;
+			goto fail_nodes;
+		}
+		/* a bad policy leaves it local */
+		scull_pages_set_numa(scullp_devices[i].pages, scullp_numa,
+				scullp_node);
 		sema_init (&scullp_devices[i].sem, 1);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
@@ -575,8 +659,15 @@ int scullp_init(void)
 #ifdef SCULLP_USE_PROC /* only when available */
 	create_proc_read_entry("scullpmem", 0, NULL, scullp_read_procmem, NULL);
 #endif
+	scullp_vm_init();
 	return 0; /* succeed */
 
+  fail_nodes:
+	while (i--) {
+		cdev_del(&scullp_devices[i].cdev);
+		kfree(scullp_devices[i].pages);
+	}
+	kfree(scullp_devices);
   fail_malloc:
 	unregister_chrdev_region(dev, scullp_devs);
 	return result;
@@ -591,10 +682,12 @@ void scullp_cleanup(void)
 #ifdef SCULLP_USE_PROC
 	remove_proc_entry("scullpmem", NULL);
 #endif
+	scullp_vm_cleanup();
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
 		scullp_trim(scullp_devices + i);
+		kfree(scullp_devices[i].pages);
 	}
 	kfree(scullp_devices);
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
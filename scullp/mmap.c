@@ -23,7 +23,40 @@
 #include <linux/fs.h>
 
 #include "scullp.h"		/* local definitions */
+#include "../include/scullfault.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+
+/*
+ * Tracepoints and latency histograms, see scullfault.h
+ */
+static ktime_t scullp_vm_start(int op, int minor, unsigned long pgoff,
+		unsigned long npages)
+{
+	trace_scullp_vm_start(op, minor, pgoff, npages);
+	return ktime_get();
+}
+
+static void scullp_vm_done(int op, int minor, unsigned long pgoff, int ret,
+		ktime_t start, ktime_t locked)
+{
+	s64 wait, total;
+
+	scull_vm_account(op, start, locked, &wait, &total);
+	trace_scullp_vm_done(op, minor, pgoff, ret, wait, total);
+}
+
+void scullp_vm_init(void)
+{
+	scull_vm_lat_init("scullp");
+}
+
+void scullp_vm_cleanup(void)
+{
+	scull_vm_lat_cleanup();
+}
 
 /*
  * open and close: just keep track of how many times the device is
@@ -44,44 +77,61 @@ void scullp_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find the page backing page offset "pgoff" of the device, or NULL
+ * for a hole or end-of-file. Must be called with the semaphore held.
+ *
+ * Quanta are made of compound pages (see scull_pages_alloc), so any
+ * page inside a multipage block can be handed out: get_page() and
+ * put_page() on a tail page act on the head page, and the block is
+ * only released as a whole by scullp_trim.
+ */
+static struct page *scullp_vma_lookup(struct scullp_dev *dev, unsigned long pgoff)
+{
+	struct scullp_dev *ptr;
+	unsigned long qpages = 1UL << dev->order; /* pages per quantum */
+	unsigned long s_pos;
+	int avail;
+
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return NULL; /* out of range */
+
+	/*
+	 * Now retrieve the scullp device from the list, then the quantum,
+	 * then the page within the quantum.
+	 */
+	for (ptr = dev; ptr && pgoff >= dev->qset * qpages;) {
+		ptr = ptr->next;
+		pgoff -= dev->qset * qpages;
+	}
+	if (!ptr || !ptr->data)
+		return NULL;
+	s_pos = pgoff >> dev->order;
+	if (!ptr->data[s_pos])
+		return NULL; /* hole */
+	return virt_to_page(scullp_quantum_ptr(dev, ptr, s_pos,
+			(pgoff & (qpages - 1)) << PAGE_SHIFT, &avail));
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
  * page required from the scullp device and returns it to the
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
  */
-
 static int scullp_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	unsigned long offset;
-	struct scullp_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
+	struct scullp_dev *dev = vma->vm_private_data;
+	int minor = MINOR(dev->cdev.dev);
+	struct page *page;
 	int retval = VM_FAULT_NOPAGE;
+	ktime_t start, locked;
 
+	start = scullp_vm_start(SCULL_VM_FAULT, minor, vmf->pgoff, 1);
 	down(&dev->sem);
-	offset = (unsigned long)(vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullp device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
+	locked = ktime_get();
+	page = scullp_vma_lookup(dev, vmf->pgoff);
+	if (!page) goto out; /* hole or end-of-file */
 
 	/* got it, now increment the count */
 	get_page(page);
@@ -90,6 +140,7 @@ static int scullp_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 
   out:
 	up(&dev->sem);
+	scullp_vm_done(SCULL_VM_FAULT, minor, vmf->pgoff, retval, start, locked);
 	return retval;
 }
 
@@ -102,19 +153,52 @@ struct vm_operations_struct scullp_vm_ops = {
 };
 
 
-int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
+/*
+ * Huge quanta (SCULLP_HUGE_ORDER or more) are populated as a whole
+ * at mmap time: the kernel offers drivers no way to install a PMD
+ * entry for their own pages, so the best we can do for scanners is
+ * to take every fault up front. Holes are left to "nopage".
+ */
+static void scullp_vma_populate(struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct scullp_dev *dev = vma->vm_private_data;
+	int minor = MINOR(dev->cdev.dev);
+	unsigned long addr;
+	struct page *page;
+	ktime_t start, locked;
+	int mapped = 0;
+
+	start = scullp_vm_start(SCULL_VM_POPULATE, minor, vma->vm_pgoff,
+			(vma->vm_end - vma->vm_start) >> PAGE_SHIFT);
+	down(&dev->sem);
+	locked = ktime_get();
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		page = scullp_vma_lookup(dev, vma->vm_pgoff +
+				((addr - vma->vm_start) >> PAGE_SHIFT));
+		if (!page)
+			continue;
+		if (vm_insert_page(vma, addr, page))
+			break; /* let "nopage" do the rest */
+		mapped++;
+	}
+	up(&dev->sem);
+	/* the pages mapped now, out of those asked for */
+	scullp_vm_done(SCULL_VM_POPULATE, minor, vma->vm_pgoff, mapped, start,
+			locked);
+}
+
 
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
+int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scullp_dev *dev = filp->private_data;
 
-	/* don't do anything here: "nopage" will set up page table entries */
+	/* "nopage" will set up page table entries, one page at a time */
 	vma->vm_ops = &scullp_vm_ops;
 	vma->vm_flags |= VM_RESERVED;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = dev;
 	scullp_vma_open(vma);
+	if (dev->order >= SCULLP_HUGE_ORDER)
+		scullp_vma_populate(vma);
 	return 0;
 }
 
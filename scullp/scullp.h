@@ -16,6 +16,7 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include "../include/scullpages.h"
 
 /*
  * Macros to help debugging
@@ -53,13 +54,30 @@
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
+/*
+ * Quanta of this order or more are mapped in full when the device is
+ * mmapped, rather than faulted in one page at a time. PMD_SHIFT makes
+ * it 2MB on x86-64, the size the hardware could map with one entry.
+ */
+#define SCULLP_HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
+
+/*
+ * NUMA placement and fallback to lower orders: see scullpages.h
+ */
+#define SCULLP_NUMA_LOCAL       SCULL_NUMA_LOCAL
+#define SCULLP_NUMA_NODE        SCULL_NUMA_NODE
+#define SCULLP_NUMA_INTERLEAVE  SCULL_NUMA_INTERLEAVE
+#define SCULLP_NR_ORDERS        SCULL_NR_ORDERS
+
 struct scullp_dev {
 	void **data;
+	unsigned char *orders;    /* order of each quantum, if not all "order" */
 	struct scullp_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct scull_pages *pages; /* placement and usage, head only */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -75,12 +93,18 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_numa;
+extern int scullp_node;
 
 /*
  * Prototypes for shared functions
  */
 int scullp_trim(struct scullp_dev *dev);
+void scullp_vm_init(void);		/* mmap.c */
+void scullp_vm_cleanup(void);
 struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
+void *scullp_quantum_ptr(struct scullp_dev *dev, struct scullp_dev *dptr,
+		int s_pos, int q_pos, int *avail);
 
 
 #ifdef SCULLP_DEBUG
@@ -117,7 +141,21 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCXQSET    _IOWR(SCULLP_IOC_MAGIC,11, int)
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
-#define SCULLP_IOC_MAXNR 12
+/*
+ * NUMA placement is per device, and takes effect with the next
+ * quantum allocated.
+ */
+struct scullp_numa {
+	int policy;               /* SCULLP_NUMA_* */
+	int node;                 /* only used by SCULLP_NUMA_NODE */
+};
+#define SCULLP_IOCSNUMA    _IOW(SCULLP_IOC_MAGIC, 13, struct scullp_numa)
+#define SCULLP_IOCGNUMA    _IOR(SCULLP_IOC_MAGIC, 14, struct scullp_numa)
+
+/* How many quanta were allocated at each order, since the last trim */
+#define SCULLP_IOCGHIST    _IOR(SCULLP_IOC_MAGIC, 15, __u64[SCULLP_NR_ORDERS])
+
+#define SCULLP_IOC_MAXNR 15
 
 
 
@@ -27,7 +27,7 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
 #include <asm/uaccess.h>
-#include <linux/vmalloc.h>
+#include <linux/mm.h>		/* alloc_page() */
 #include "scullv.h"		/* local definitions */
 
 
@@ -161,6 +161,24 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Return page "pg" of quantum "s_pos" in the list item "dptr",
+ * allocating it if needed. The quantum must be present.
+ *
+ * We used to vmalloc() each quantum, paying for a vmap area and its
+ * TLB flushes on every allocation and release. Pages are now kept in
+ * an array and used through the kernel direct mapping, so they need
+ * no virtual window at all, and mmap can hand them out as they are.
+ */
+struct page *scullv_get_page(struct scullv_dev *dptr, int s_pos, int pg)
+{
+	struct page **pages = dptr->data[s_pos];
+
+	if (!pages[pg])
+		pages[pg] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	return pages[pg];
+}
+
 /*
  * Data management: read and write
  */
@@ -173,7 +191,8 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, done, chunk, offset;
+	struct page **pages, *page;
 	ssize_t retval = 0;
 
 	if (down_interruptible (&dev->sem))
@@ -197,9 +216,17 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* read only up to the end of this quantum */
 
-	if (copy_to_user (buf, dptr->data[s_pos]+q_pos, count)) {
-		retval = -EFAULT;
-		goto nothing;
+	/* Copy page by page; pages never written read as zeroes */
+	pages = dptr->data[s_pos];
+	for (done = 0; done < count; done += chunk) {
+		offset = (q_pos + done) & ~PAGE_MASK;
+		chunk = min_t(int, count - done, PAGE_SIZE - offset);
+		page = pages[(q_pos + done) >> PAGE_SHIFT];
+		if (page ? copy_to_user(buf + done, page_address(page) + offset, chunk)
+				: clear_user(buf + done, chunk)) {
+			retval = -EFAULT;
+			goto nothing;
+		}
 	}
 	up (&dev->sem);
 
@@ -221,7 +248,8 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, done, chunk, offset;
+	struct page *page;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (down_interruptible (&dev->sem))
@@ -240,19 +268,31 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 			goto nomem;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	/* Allocate a quantum using virtual addresses */
+	/* Allocate a quantum: just the page array, pages come later */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
+		dptr->data[s_pos] = kzalloc(sizeof(struct page *) << dev->order,
+				GFP_KERNEL);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto nomem;
+
+	/* Copy page by page, allocating the ones we touch */
+	for (done = 0; done < count; done += chunk) {
+		offset = (q_pos + done) & ~PAGE_MASK;
+		chunk = min_t(int, count - done, PAGE_SIZE - offset);
+		page = scullv_get_page(dptr, s_pos, (q_pos + done) >> PAGE_SHIFT);
+		if (!page)
+			break;
+		if (copy_from_user(page_address(page) + offset, buf + done, chunk)) {
+			retval = -EFAULT;
+			goto nomem;
+		}
 	}
+	if (!done)
+		goto nomem;
+	count = done;
 	*f_pos += count;
  
     	/* update the size */
@@ -490,7 +530,8 @@ int scullv_trim(struct scullv_dev *dev)
 {
 	struct scullv_dev *next, *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	struct page **pages;
+	int i, j;
 
 	if (dev->vmas) /* don't trim: there are active mappings */
 		return -EBUSY;
@@ -498,9 +539,15 @@ int scullv_trim(struct scullv_dev *dev)
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			/* Release the quantum-set */
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					vfree(dptr->data[i]);
+			for (i = 0; i < qset; i++) {
+				pages = dptr->data[i];
+				if (!pages)
+					continue;
+				for (j = 0; j < 1 << dev->order; j++)
+					if (pages[j])
+						__free_page(pages[j]);
+				kfree(pages);
+			}
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -574,6 +621,7 @@ int scullv_init(void)
 #ifdef SCULLV_USE_PROC /* only when available */
 	create_proc_read_entry("scullvmem", 0, NULL, scullv_read_procmem, NULL);
 #endif
+	scullv_vm_init();
 	return 0; /* succeed */
 
   fail_malloc:
@@ -590,6 +638,7 @@ void scullv_cleanup(void)
 #ifdef SCULLV_USE_PROC
 	remove_proc_entry("scullvmem", NULL);
 #endif
+	scullv_vm_cleanup();
 
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
@@ -23,7 +23,40 @@
 #include <linux/fs.h>
 
 #include "scullv.h"		/* local definitions */
+#include "../include/scullfault.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+
+/*
+ * Tracepoints and latency histograms, see scullfault.h
+ */
+static ktime_t scullv_vm_start(int op, int minor, unsigned long pgoff,
+		unsigned long npages)
+{
+	trace_scullv_vm_start(op, minor, pgoff, npages);
+	return ktime_get();
+}
+
+static void scullv_vm_done(int op, int minor, unsigned long pgoff, int ret,
+		ktime_t start, ktime_t locked)
+{
+	s64 wait, total;
+
+	scull_vm_account(op, start, locked, &wait, &total);
+	trace_scullv_vm_done(op, minor, pgoff, ret, wait, total);
+}
+
+void scullv_vm_init(void)
+{
+	scull_vm_lat_init("scullv");
+}
+
+void scullv_vm_cleanup(void)
+{
+	scull_vm_lat_cleanup();
+}
 
 /*
  * open and close: just keep track of how many times the device is
@@ -50,44 +83,44 @@ void scullv_vma_close(struct vm_area_struct *vma)
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * The quanta are arrays of single pages, so the order doesn't
+ * matter here, and no vmalloc_to_page() walk is needed.
  */
 
 static int scullv_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	unsigned long offset;
+	unsigned long offset, qpages;
 	struct scullv_dev *ptr, *dev = vma->vm_private_data;
+	int minor = MINOR(dev->cdev.dev);
 	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
+	int retval = VM_FAULT_SIGBUS;
+	ktime_t start, locked;
 
+	start = scullv_vm_start(SCULL_VM_FAULT, minor, vmf->pgoff, 1);
 	down(&dev->sem);
-	offset = (unsigned long)(vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	locked = ktime_get();
+	offset = vmf->pgoff << PAGE_SHIFT;
 	if (offset >= dev->size) goto out; /* out of range */
 
 	/*
-	 * Now retrieve the scullv device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
+	 * Now retrieve the scullv device from the list, then the quantum,
+	 * then the page. If the device has holes, the process receives a
+	 * SIGBUS when accessing the hole; a page not yet written in an
+	 * existing quantum is allocated here, as read() shows it as zeroes.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
+	offset = vmf->pgoff; /* offset is a number of pages */
+	qpages = 1UL << dev->order;
+	for (ptr = dev; ptr && offset >= dev->qset * qpages;) {
 		ptr = ptr->next;
-		offset -= dev->qset;
+		offset -= dev->qset * qpages;
+	}
+	if (!ptr || !ptr->data || !ptr->data[offset >> dev->order])
+		goto out; /* hole or end-of-file */
+	page = scullv_get_page(ptr, offset >> dev->order, offset & (qpages - 1));
+	if (!page) {
+		retval = VM_FAULT_OOM;
+		goto out;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-
-	/*
-	 * After scullv lookup, "page" is now the address of the page
-	 * needed by the current process. Since it's a vmalloc address,
-	 * turn it into a struct page.
-	 */
-	page = vmalloc_to_page(pageptr);
 
 	/* got it, now increment the count */
 	get_page(page);
@@ -96,6 +129,7 @@ static int scullv_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 
   out:
 	up(&dev->sem);
+	scullv_vm_done(SCULL_VM_FAULT, minor, vmf->pgoff, retval, start, locked);
 	return retval;
 }
 
@@ -46,7 +46,9 @@
  * Use a linked list of indirect blocks.
  *
  * "scullv_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * pointer refers to a quantum: an array of (1 << order) struct page
+ * pointers. Pages are only allocated when first written, and a
+ * missing page in a quantum reads as zeroes.
  *
  * The array (quantum-set) is SCULLV_QSET long.
  */
@@ -80,7 +82,10 @@ extern int scullv_qset;
  * Prototypes for shared functions
  */
 int scullv_trim(struct scullv_dev *dev);
+void scullv_vm_init(void);		/* mmap.c */
+void scullv_vm_cleanup(void);
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
+struct page *scullv_get_page(struct scullv_dev *dptr, int s_pos, int pg);
 
 
 #ifdef SCULLV_DEBUG
@@ -0,0 +1,94 @@
+/*
+ * trace.h -- tracepoints for the scullv module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scullv
+
+#if !defined(_SCULLV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULLV_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* the operations are in scullfault.h */
+#define show_scullv_vm_op(op)					\
+	__print_symbolic(op,					\
+		{ SCULL_VM_FAULT,    "fault" },			\
+		{ SCULL_VM_POPULATE, "populate" })
+
+TRACE_EVENT(scullv_vm_start,
+
+	TP_PROTO(int op, int minor, unsigned long pgoff, unsigned long npages),
+
+	TP_ARGS(op, minor, pgoff, npages),
+
+	TP_STRUCT__entry(
+		__field(int,		op)
+		__field(int,		minor)
+		__field(unsigned long,	pgoff)
+		__field(unsigned long,	npages)
+	),
+
+	TP_fast_assign(
+		__entry->op	= op;
+		__entry->minor	= minor;
+		__entry->pgoff	= pgoff;
+		__entry->npages	= npages;
+	),
+
+	TP_printk("%s minor=%d pgoff=%lu npages=%lu",
+		show_scullv_vm_op(__entry->op), __entry->minor,
+		__entry->pgoff, __entry->npages)
+);
+
+TRACE_EVENT(scullv_vm_done,
+
+	TP_PROTO(int op, int minor, unsigned long pgoff, int ret, s64 wait_ns,
+		s64 total_ns),
+
+	TP_ARGS(op, minor, pgoff, ret, wait_ns, total_ns),
+
+	TP_STRUCT__entry(
+		__field(int,		op)
+		__field(int,		minor)
+		__field(unsigned long,	pgoff)
+		__field(int,		ret)
+		__field(s64,		wait_ns)
+		__field(s64,		total_ns)
+	),
+
+	TP_fast_assign(
+		__entry->op	  = op;
+		__entry->minor	  = minor;
+		__entry->pgoff	  = pgoff;
+		__entry->ret	  = ret;
+		__entry->wait_ns  = wait_ns;
+		__entry->total_ns = total_ns;
+	),
+
+	TP_printk("%s minor=%d pgoff=%lu ret=%d lock_wait=%lldns total=%lldns",
+		show_scullv_vm_op(__entry->op), __entry->minor,
+		__entry->pgoff, __entry->ret,
+		(long long)__entry->wait_ns, (long long)__entry->total_ns)
+);
+
+#endif /* _SCULLV_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>